@@ -1,12 +1,65 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ac.h"
+#include "errno.h"
+#include "math.h"
+#include "poll.h"
+#include "pthread.h"
+#include "signal.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
+#include "sys/resource.h"
+#include "sys/socket.h"
+#include "sys/stat.h"
+#include "sys/time.h"
+#include "sys/un.h"
 #include "time.h"
+#include "unistd.h"
 
 #define VALID        1 
 #define INVALID      0
-#define UNDEFINED    255
+#define UNDEFINED    65535
+#define MAX_AREA     1024
+
+// The widest grid a 64-bit window can hold, wider grids are stored transposed.
+#define BOARD_MAX_WIDTH 31
+// Room bits plus a padding row on each side and a word read past the end.
+#define BOARD_WORDS  ((MAX_AREA + 2 * BOARD_MAX_WIDTH + 63) / 64 + 2)
+
+// Subtrees with fewer rooms left are cheaper to search than to look up.
+#define MEMO_MIN_DELTA 12
+#define MEMO_WAYS    4
+
+// The widths duct_search has a kernel for, the width is a constant there.
+#define KERNEL_MIN_WIDTH 4
+#define KERNEL_MAX_WIDTH 16
+// Marks the hot functions, so every kernel gets its own copy of them.
+#define KERNEL static inline __attribute__((always_inline))
+// Marks the functions the library never calls, those of main and debugging aids.
+#define COMMAND static __attribute__((unused))
+
+// Bytes read from stdin at a time, and the first bytes of a binary plan.
+#define INPUT_BLOCK  (1 << 16)
+#define BINARY_MAGIC "DUCT"
+
+// Output buffer of the enumeration, and the first bytes of its output.
+#define LIST_BUFFER  (1 << 20)
+#define LIST_MAGIC   "PATH"
+
+// Search loop iterations between two looks at the clock, minus one.
+#define CHECKPOINT_TICKS ((1 << 20) - 1)
+#define CHECKPOINT_MAGIC "DUCTCKPT"
+
+// Default memory cap of the bidirectional search.
+#define BIDIRECTIONAL_BYTES (1ULL << 30)
+
+// Default memory cap of the frontier tables before they spill to disk.
+#define EXTERNAL_BYTES (1ULL << 30)
 
 typedef unsigned char uchar;
+typedef unsigned short ushort;
+typedef unsigned long long ullong;
 typedef char bool;
 
 typedef enum RoomTypeEnum {
@@ -22,43 +75,145 @@ typedef enum RoomTypeEnum {
     IGNORE
 } RoomType;
 
-// A linked list of steps, representing a path.
-typedef struct StepStruct {
-    uchar position;
-    struct StepStruct * next;
-} Step;
+// Half ducts keyed by their visited rooms and tip, used by the bidirectional search.
+typedef struct HalfMapStruct {
+    ullong* keys;       // capacity keys of stride words: the bitboard words, then the tip.
+    ullong* counts;     // 0 marks an empty slot.
+    uchar   stride;
+    size_t  size;
+    size_t  capacity;
+    size_t  limit;      // most keys allowed by the memory cap.
+} HalfMap;
+
+// Search prefixes cut off at a fixed depth, counted later by the worker threads.
+typedef struct TaskListStruct {
+    ushort  length;     // number of positions in every prefix, start included.
+    ushort* paths;      // size * length positions, first position first.
+    ullong* results;    // the count of each prefix once it has been searched.
+    uchar*  weights;    // how many symmetric prefixes each one stands for.
+    uchar   weight;     // the weight given to the prefixes added next.
+    HalfMap* halves;    // when set, prefixes are gathered there instead of listed.
+    bool    full;       // true once halves hit its memory cap, the search unwinds.
+    size_t  size;
+    size_t  capacity;
+} TaskList;
+
+// A finished subtree of the search and its count.
+typedef struct MemoEntryStruct {
+    ullong check;       // hash of the visited rooms and the tip, remaining rooms in the low 16 bits.
+    ullong count;
+} MemoEntry;
+
+// A transposition table of subtree counts with a fixed memory budget.
+typedef struct MemoStruct {
+    MemoEntry* entries; // (mask + 1) buckets of MEMO_WAYS entries.
+    ullong mask;
+    ullong hits;
+    ullong misses;
+    ullong stores;
+    ullong evictions;
+} Memo;
+
+typedef enum ListModeEnum {
+    LIST_ALL,
+    LIST_FIRST,         // the first limit ducts.
+    LIST_EVERY,         // every limit-th duct, starting with the first.
+    LIST_SAMPLE         // limit ducts drawn uniformly at random.
+} ListMode;
+
+// Where the ducts found by the search are written, see list_add.
+typedef struct ListStruct {
+    ListMode mode;
+    ullong  limit;
+    ullong  found;      // ducts handed to the list so far.
+    ullong  written;
+    bool    text;       // one line of letters per duct instead of 2 bits per move.
+    ushort  moves;      // moves per duct.
+    int     record;     // bytes per duct.
+    bool    transposed;
+    ullong  random;     // xorshift state of the sampling.
+    uchar*  buffer;     // LIST_BUFFER bytes, written out when full.
+    size_t  size;
+    uchar*  samples;    // limit records kept by the sampling.
+} List;
+
+#ifdef DUCT_STATS
+// Search counters, built with -DDUCT_STATS; every engine and worker keeps its own.
+typedef struct StatsStruct {
+    ullong nodes[MAX_AREA];     // rooms entered by the search, by path length - 1.
+    ullong previous_neighbor;   // how often each check rejected a room.
+    ullong tip_neighbor;
+    ullong end;
+    ullong edge;
+    ullong split;
+    ullong early_end;           // moves onto the AC with rooms left to cover.
+    ullong walked;              // corridor rooms pushed by duct_walk without a check.
+    long int read_ms;
+    long int preprocess_ms;
+} Stats;
+
+#define STAT(duct, counter) ((duct)->stats.counter++)
+#else
+#define STAT(duct, counter) ((void) 0)
+#endif
+
+// Periodic saves of a running search, see checkpoint_write.
+typedef struct CheckpointStruct {
+    const char* file;
+    long int interval_ms;
+    long int last_ms;   // when the last checkpoint was written.
+    ullong  fingerprint; // of the plan, a checkpoint only resumes the same plan.
+    ullong  root_moves; // the first moves left, the one being searched included.
+    ullong  root_result;
+    bool    resumed;    // true until the loaded state has been restored.
+    ushort  base;       // the loaded state.
+    ushort  length;
+    ullong  result;
+    ushort  path[MAX_AREA];
+    ullong  moves[MAX_AREA];
+    ullong  counts[MAX_AREA];
+} Checkpoint;
 
 // A data structure for the problem.
 typedef struct DuctStruct {
-    uchar  height;      // width of the data center.
-    uchar  width;       // height of the data center.
-    uchar* mask;        // a 1D array of masks, 1 means the room has been visited or those we do not own.
-    Step*  tip;         // a linked list of steps, last position first.
-    uchar  max_length;  // how many steps needed to complete the path.
-    uchar  delta;       // how many steps to go in a given solution.
-    uchar  start;       // starting position.
-    uchar  end;         // ending position.
+    ushort height;      // width of the data center.
+    ushort width;       // height of the data center.
+    ullong board[BOARD_WORDS]; // a bit per room, 1 means the room has been visited or we do not own it.
+    ushort path[MAX_AREA];   // the positions of the duct so far, first position first.
+    ullong moves[MAX_AREA];  // per path position, the window bits of the moves still to try.
+    ushort length;      // how many positions are on the path.
+    ullong counts[MAX_AREA]; // per path position, the result when the room was entered.
+    uchar  words;       // how many board words hold rooms.
+    bool   transposed;  // true if the plan is stored transposed, see BOARD_MAX_WIDTH.
+    ushort max_length;  // how many steps needed to complete the path.
+    ushort delta;       // how many steps to go in a given solution.
+    ushort start;       // starting position.
+    ushort end;         // ending position.
     RoomType* rooms;    // a 1D array of all the room types.
+    ullong* links;      // per room window mask of the neighbours we own.
+    ullong* sides;      // per edge room window mask of the two neighbours along the edge.
+    uchar* corridors;   // per room, 1 if it has exactly two links left, so its way out is forced.
+    bool infeasible;    // true if preprocessing proved there is no duct.
     bool special;       // true if the starting position is an edge room.
+    TaskList* tasks;    // when set, paths reaching tasks->length are recorded instead of searched.
+    Memo*  memo;        // when set, subtree counts are looked up and stored there.
+    List*  list;        // when set, every duct found is written there.
+    Checkpoint* checkpoint; // when set, the search state is saved there from time to time.
+    uchar* weights;     // per first move, the size of its symmetry class, NULL without symmetry.
+    long int deadline;  // clock_ms after which the count is given up, 0 for none.
+    bool   expired;     // true once the count was given up.
+    const char* failure; // why the count can not be trusted, NULL if it can.
+    AcStatus status;    // how the library reports failure, or error for want of memory.
+    const char* error;  // why the plan could not be read, NULL if it was.
+#ifdef DUCT_STATS
+    Stats  stats;
+#endif
 } Duct;
 
 /**
  * Step related functions.
  */
-Step* step_init(uchar position) {
-    Step* step = malloc(sizeof(Step));
-    if (NULL != step) {
-        step->position = position;
-    }
-    return step;
-}
-
-char step_dir(Step* step, Step* prev, uchar width) {
-    if (NULL == prev) {
-        return '*';
-    }
-    uchar curr_pos = step->position;
-    uchar prev_pos = prev->position;
+static char step_dir(ushort curr_pos, ushort prev_pos, ushort width) {
     if (curr_pos - prev_pos == width) {
         return '^'; 
     } else if (prev_pos - curr_pos == width) {
@@ -72,60 +227,351 @@ char step_dir(Step* step, Step* prev, uchar width) {
     }
 }
 
-void step_destroy(Step* step) {
-    if (NULL != step) {
-        free(step);
-        step = NULL;
+static void duct_link(Duct* duct);
+static void duct_reduce(Duct* duct);
+static void duct_symmetry(Duct* duct);
+static long int clock_ms();
+
+/**
+ * Bitboard related functions.
+ *
+ * The visited rooms are kept as a bitboard with one padding row above and
+ * below the grid, room p lives at bit p + width.  Reading 64 bits starting at
+ * bit p gives a window holding room p at bit width and its four neighbours at
+ * bits 0 (up), width - 1 (left), width + 1 (right) and 2 * width (down), so
+ * per-room masks in window coordinates turn every neighbour test into an AND.
+ */
+static ullong board_window(const ullong* board, int bit) {
+    int word = bit >> 6;
+    int shift = bit & 63;
+    return (board[word] >> shift) | ((board[word + 1] << 1) << (63 - shift));
+}
+
+static bool board_test(const ullong* board, int bit) {
+    return (board[bit >> 6] >> (bit & 63)) & 1;
+}
+
+static void board_set(ullong* board, int bit) {
+    board[bit >> 6] |= 1ULL << (bit & 63);
+}
+
+static void board_clear(ullong* board, int bit) {
+    board[bit >> 6] &= ~(1ULL << (bit & 63));
+}
+
+/**
+ * Input related functions.
+ *
+ * Plans are read from stdin a block at a time and the numbers are parsed
+ * here, one scanf per room costs more than the search on small plans.
+ * A plan is either text (width, height, then one number per room) or
+ * binary: BINARY_MAGIC, the width and height as little endian 16-bit
+ * numbers, then 2 bits per room, four rooms per byte, first room in the
+ * low bits.  Both kinds may be mixed in one stream.
+ */
+typedef struct InputStruct {
+    uchar buffer[INPUT_BLOCK];
+    int   size;
+    int   at;
+    int   fd;           // stdin, or the connection of a daemon.
+} Input;
+
+// A plan as read, one value per room in reading order.
+typedef struct PlanStruct {
+    int   width;
+    int   height;
+    int*  values;
+    const char* error;  // why the plan could not be read, NULL if it was.
+    bool  no_memory;    // true if it could not be read for want of memory.
+} Plan;
+
+static void input_init(Input* input) {
+    input->size = 0;
+    input->at = 0;
+    input->fd = STDIN_FILENO;
+}
+
+static int input_peek(Input* input) {
+    if (input->at == input->size) {
+        ssize_t size = read(input->fd, input->buffer, INPUT_BLOCK);
+        if (size <= 0) {
+            return EOF;
+        }
+        input->size = size;
+        input->at = 0;
+    }
+    return input->buffer[input->at];
+}
+
+static int input_get(Input* input) {
+    int c = input_peek(input);
+    if (c != EOF) {
+        input->at++;
     }
+    return c;
+}
+
+static bool input_space(int c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
 }
 
 /**
- * Duct related functions.
+ * Skips whitespace, returns INVALID at the end of the input.
  */
-void duct_read(Duct* duct) {
+static bool input_more(Input* input) {
+    int c = input_peek(input);
+    while (input_space(c)) {
+        input->at++;
+        c = input_peek(input);
+    }
+    return c != EOF;
+}
 
-    int width = 0;
-    int height = 0;
+/**
+ * Reads a decimal number into value.  Returns 1, EOF at the end of the
+ * input, or 0 if the next token is not a number; that token is skipped.
+ */
+static int input_int(Input* input, int* value) {
+    if (!input_more(input)) {
+        return EOF;
+    }
+    int c = input_get(input);
+    bool negative = c == '-';
+    if (negative || c == '+') {
+        c = input_get(input);
+    }
+    bool digits = 0;
+    long long number = 0;
+    while (c >= '0' && c <= '9') {
+        if (number < 1000000000) {
+            // larger numbers are all invalid, stop before they overflow.
+            number = number * 10 + (c - '0');
+        }
+        digits = 1;
+        c = input_get(input);
+    }
+    if (!digits || (c != EOF && !input_space(c))) {
+        while (c != EOF && !input_space(c)) {
+            c = input_get(input);
+        }
+        return 0;
+    }
+    *value = negative ? -number : number;
+    return 1;
+}
 
-    if (scanf("%d", &(width)) != 1 ||
-        scanf("%d", &(height)) != 1) {
-        printf("Unable to read width or height.\n");
-        exit(1); 
+/**
+ * Skips count numbers of a text plan that can not be used.
+ */
+static void input_skip(Input* input, long long count) {
+    int value = 0;
+    for (long long i = 0; i < count; ++i) {
+        if (input_int(input, &value) == EOF) {
+            return;
+        }
     }
+}
 
-    if (width <= 0 || height<= 0) {
-        printf("The width or height is invalid: %d %d.\n", width, height);
-        exit(1);
+/**
+ * Why a plan of the given size can not be used, NULL if it can.
+ */
+static const char* plan_check_size(int width, int height) {
+    if (width <= 0 || height <= 0) {
+        return "The width or height is invalid.";
+    } else if (width == 1 || height == 1) {
+        return "The room is too small.";
+    } else if ((long long) width * height > MAX_AREA ||
+               (width > BOARD_MAX_WIDTH && height > BOARD_MAX_WIDTH)) {
+        return "The room is too large.";
+    }
+    return NULL;
+}
+
+static bool plan_read_binary(Input* input, Plan* plan) {
+    uchar header[8];
+    for (int i = 0; i < 8; ++i) {
+        int c = input_get(input);
+        if (c == EOF || (i < 4 && c != BINARY_MAGIC[i])) {
+            plan->error = "Invalid input.";
+            return INVALID;
+        }
+        header[i] = c;
+    }
+    plan->width = header[4] | header[5] << 8;
+    plan->height = header[6] | header[7] << 8;
+
+    long long area = (long long) plan->width * plan->height;
+    long long bytes = (area + 3) >> 2;
+    plan->error = plan_check_size(plan->width, plan->height);
+    if (NULL == plan->error) {
+        plan->values = malloc(sizeof(int) * area);
+        if (NULL == plan->values) {
+            // the rest of the plan is still skipped below.
+            plan->error = "Unable to allocate memory";
+            plan->no_memory = 1;
+        }
+    }
+    for (long long i = 0; i < bytes; ++i) {
+        int c = input_get(input);
+        if (c == EOF) {
+            plan->error = "Invalid input.";
+            break;
+        }
+        for (int k = 0; NULL != plan->values && k < 4 && (i << 2) + k < area; ++k) {
+            plan->values[(i << 2) + k] = (c >> (k << 1)) & 3;
+        }
+    }
+    return NULL == plan->error;
+}
+
+/**
+ * Reads the next plan.  On bad input the rest of the plan is skipped and
+ * plan->error tells why, so a stream of plans can go on with the next one.
+ */
+static bool plan_read(Input* input, Plan* plan) {
+    plan->values = NULL;
+    plan->error = NULL;
+    plan->no_memory = 0;
+
+    if (input_more(input) && input_peek(input) == BINARY_MAGIC[0]) {
+        return plan_read_binary(input, plan);
+    }
+
+    if (input_int(input, &plan->width) != 1 ||
+        input_int(input, &plan->height) != 1) {
+        plan->error = "Unable to read width or height.";
+        return INVALID;
+    }
+    plan->error = plan_check_size(plan->width, plan->height);
+    if (NULL != plan->error) {
+        if (plan->width > 0 && plan->height > 0) {
+            input_skip(input, (long long) plan->width * plan->height);
+        }
+        return INVALID;
+    }
+
+    int area = plan->width * plan->height;
+    plan->values = malloc(sizeof(int) * area);
+    if (NULL == plan->values) {
+        plan->error = "Unable to allocate memory";
+        plan->no_memory = 1;
+        input_skip(input, area);
+        return INVALID;
+    }
+    for (int i = 0; i < area; ++i) {
+        int read = input_int(input, &plan->values[i]);
+        if (read != 1) {
+            plan->error = "Invalid input.";
+            if (read == 0) {
+                input_skip(input, area - i - 1);
+            }
+            return INVALID;
+        }
     }
+    return VALID;
+}
 
-    if (width == 1 || height == 1) {
-        printf("The room is too small.\n");
+/**
+ * Writes a plan in the binary format, INVALID if a room is not 0 to 3.
+ */
+static bool plan_write(const Plan* plan, FILE* output) {
+    int area = plan->width * plan->height;
+    uchar header[8] = {
+        BINARY_MAGIC[0], BINARY_MAGIC[1], BINARY_MAGIC[2], BINARY_MAGIC[3],
+        plan->width & 0xff, plan->width >> 8, plan->height & 0xff, plan->height >> 8
+    };
+    uchar* cells = calloc((area + 3) >> 2, sizeof(uchar));
+    if (NULL == cells) {
+        printf("Unable to allocate memory\n");
         exit(1);
     }
+    for (int i = 0; i < area; ++i) {
+        if (plan->values[i] < 0 || plan->values[i] > 3) {
+            free(cells);
+            return INVALID;
+        }
+        cells[i >> 2] |= plan->values[i] << ((i & 3) << 1);
+    }
+    fwrite(header, 1, sizeof(header), output);
+    fwrite(cells, 1, (area + 3) >> 2, output);
+    free(cells);
+    return VALID;
+}
+
+/**
+ * Duct related functions.
+ *
+ * Gives up the count with status for the library, why for both; the first
+ * failure is the one reported.
+ */
+static void duct_fail(Duct* duct, AcStatus status, const char* why) {
+    if (NULL == duct->failure) {
+        duct->failure = why;
+        duct->status = status;
+    }
+}
+
+/**
+ * Gives up reading a plan for want of memory, returns INVALID.
+ */
+static bool duct_out_of_memory(Duct* duct) {
+    duct->error = "Unable to allocate memory";
+    duct->status = AC_NO_MEMORY;
+    return INVALID;
+}
+
+/**
+ * Sets duct up from a plan, taking over its values.  On a bad plan
+ * duct->error tells why and INVALID is returned.
+ */
+static bool duct_load(Duct* duct, Plan* plan) {
+
+#ifdef DUCT_STATS
+    long int begin = clock_ms();
+#endif
+    int width = plan->width;
+    int height = plan->height;
+    int* values = plan->values;
+    plan->values = NULL;
+
+    if (width > BOARD_MAX_WIDTH) {
+        // a window must hold a room and both vertical neighbours, store the grid transposed.
+        int* transposed = malloc(sizeof(int) * width * height);
+        if (NULL == transposed) {
+            free(values);
+            return duct_out_of_memory(duct);
+        }
+        for (int i = 0; i < width * height; ++i) {
+            transposed[(i % width) * height + i / width] = values[i];
+        }
+        free(values);
+        values = transposed;
+        int swap = width;
+        width = height;
+        height = swap;
+        duct->transposed = 1;
+    }
 
     duct->width = width;
     duct->height = height;
     duct->rooms = malloc(sizeof(RoomType) * duct->width * duct->height);
-    duct->mask  = malloc(sizeof(uchar) * duct->width * duct->height);
+    duct->links = malloc(sizeof(ullong) * duct->width * duct->height);
+    duct->sides = malloc(sizeof(ullong) * duct->width * duct->height);
 
-    if (NULL == duct->rooms || NULL == duct->mask) {
-        printf("Unable to allocate memory\n");
-        exit(1);
-    } 
+    if (NULL == duct->rooms || NULL == duct->links || NULL == duct->sides) {
+        free(values);
+        return duct_out_of_memory(duct);
+    }
 
     RoomType* rooms = duct->rooms;
-    uchar ignore_count = 0;
-    int n = 0;
-    for (uchar i = 0, x = 0, y = 0; scanf("%d", &n) == 1; ++i) {
+    ushort ignore_count = 0;
+    for (ushort i = 0, x = 0, y = 0; i < width * height; ++i) {
+        int n = values[i];
 
         if (n == 1) {
-            duct->mask[i] = 1;
-
             rooms[i] = IGNORE;
             ignore_count++;
         } else {
-            duct->mask[i] = 0;
-
             rooms[i] = BASIC;
             if ((0 < x && x < duct->width - 1)) {
                 if (0 == y) {
@@ -163,19 +609,16 @@ void duct_read(Duct* duct) {
                         duct->special = 1;
                     }
                 } else {
-                    printf("The start room has already been initialized.\n");
-                    exit(1);
+                    duct->error = "The start room has already been initialized.";
                 }
             } else if (n == 3) {
                 if (duct->end == UNDEFINED) {
                     duct->end = i;
                 } else {
-                    printf("The end room has already been initialized.\n");
-                    exit(1);
+                    duct->error = "The end room has already been initialized.";
                 }
             } else {
-                printf("Invalid input.\n");
-                exit(1);
+                duct->error = "Invalid input.";
             }
         }
 
@@ -185,88 +628,392 @@ void duct_read(Duct* duct) {
             y++;
         }
     }
+    free(values);
+    if (NULL != duct->error) {
+        return INVALID;
+    }
+
     // the max length of a good duct is fixed.
     duct->max_length = duct->width * duct->height - ignore_count;
     duct->delta = duct->max_length;
+
+#ifdef DUCT_STATS
+    long int read = clock_ms();
+    duct->stats.read_ms += read - begin;
+#endif
+    duct_link(duct);
+    duct_reduce(duct);
+    duct_symmetry(duct);
+#ifdef DUCT_STATS
+    duct->stats.preprocess_ms = clock_ms() - read;
+#endif
+    return NULL == duct->error;
+}
+
+/**
+ * Reads the next plan into duct.  On bad input duct->error tells why and
+ * INVALID is returned.
+ */
+static bool duct_read(Duct* duct, Input* input) {
+
+#ifdef DUCT_STATS
+    long int begin = clock_ms();
+#endif
+    Plan plan;
+    if (!plan_read(input, &plan)) {
+        free(plan.values);
+        if (plan.no_memory) {
+            return duct_out_of_memory(duct);
+        }
+        duct->error = plan.error;
+        return INVALID;
+    }
+#ifdef DUCT_STATS
+    duct->stats.read_ms = clock_ms() - begin;
+#endif
+    return duct_load(duct, &plan);
+}
+
+/**
+ * Builds the bitboard and the per-room window masks from the room types.
+ */
+static void duct_link(Duct* duct) {
+    ushort width = duct->width;
+    RoomType* rooms = duct->rooms;
+
+    ullong up    = 1ULL;
+    ullong left  = 1ULL << (width - 1);
+    ullong right = 1ULL << (width + 1);
+    ullong down  = 1ULL << (width << 1);
+
+    memset(duct->board, 0, sizeof(duct->board));
+    duct->words = (width * duct->height + (width << 1) + 63) / 64;
+    for (int i = 0; i < width * duct->height; ++i) {
+        ullong link = 0;
+        ullong side = 0;
+
+        switch (rooms[i]) {
+            case BASIC:     link = up | down | left | right; break;
+            case TOP_EDGE:  link = down | left | right;      side = left | right; break;
+            case BOT_EDGE:  link = up | left | right;        side = left | right; break;
+            case LEF_EDGE:  link = up | down | right;        side = up | down;    break;
+            case RIG_EDGE:  link = up | down | left;         side = up | down;    break;
+            case TOP_LEFT:  link = down | right; break;
+            case TOP_RIGHT: link = down | left;  break;
+            case BOT_LEFT:  link = up | right;   break;
+            case BOT_RIGHT: link = up | left;    break;
+            default:
+                board_set(duct->board, i + width);
+                break;
+        }
+
+        // rooms we do not own are never an exit.
+        for (ullong bits = link; bits; bits &= bits - 1) {
+            int neighbor = i + __builtin_ctzll(bits) - width;
+            if (rooms[neighbor] == IGNORE) {
+                link &= ~(bits & -bits);
+            }
+        }
+        duct->links[i] = link;
+        duct->sides[i] = side;
+    }
+}
+
+/**
+ * Preprocessing related functions.
+ *
+ * Before any search the plan is reduced to the edges a duct can still use,
+ * the links of the rooms are trimmed in place so every engine works on the
+ * reduced graph:
+ *   - a room with exactly two links (one for the intake or the AC) must use them all,
+ *   - a room whose forced edges are used up can not use its other links,
+ *   - a link joining two rooms of the same forced chain would close a loop,
+ *   - the intake and the AC can only be joined directly if they are the only rooms.
+ * Along the way, a room left with too few links, a loop of forced edges, a
+ * forced chain from the intake to the AC that misses rooms or a checkerboard
+ * colour count that no duct can alternate through proves there is no duct.
+ */
+static bool duct_has_edge(Duct* duct, int from, int to) {
+    int bit = to - from + duct->width;
+    return 0 <= bit && bit < 64 && ((duct->links[from] >> bit) & 1);
+}
+
+static void duct_cut_edge(Duct* duct, int from, int to) {
+    duct->links[from] &= ~(1ULL << (to - from + duct->width));
+    duct->links[to] &= ~(1ULL << (from - to + duct->width));
+}
+
+static int reduce_find(ushort* parent, int room) {
+    while (parent[room] != room) {
+        parent[room] = parent[parent[room]];
+        room = parent[room];
+    }
+    return room;
+}
+
+/**
+ * Checks the checkerboard colours: a duct alternates between them, so with
+ * an even number of rooms both colours are equal and the ends differ, with an
+ * odd number the ends both take the colour that has one more room.
+ */
+static bool duct_check_parity(Duct* duct) {
+    int count[2] = { 0, 0 };
+    ushort width = duct->width;
+    for (int i = 0; i < width * duct->height; ++i) {
+        if (duct->rooms[i] != IGNORE) {
+            count[(i % width + i / width) & 1]++;
+        }
+    }
+    int start = (duct->start % width + duct->start / width) & 1;
+    int end = (duct->end % width + duct->end / width) & 1;
+
+    if (count[0] == count[1]) {
+        return start != end;
+    } else if (count[start] == count[!start] + 1) {
+        return start == end;
+    }
+    return INVALID;
+}
+
+static bool duct_reduce_edges(Duct* duct) {
+    ushort width = duct->width;
+    int area = width * duct->height;
+    ushort start = duct->start;
+    ushort end = duct->end;
+
+    ullong forced[MAX_AREA] = { 0 };
+    ushort parent[MAX_AREA];
+    ushort size[MAX_AREA];
+    for (int i = 0; i < area; ++i) {
+        parent[i] = i;
+        size[i] = 1;
+    }
+
+    if (duct->max_length > 2 && duct_has_edge(duct, start, end)) {
+        duct_cut_edge(duct, start, end);
+    }
+
+    bool changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int p = 0; p < area; ++p) {
+            if (duct->rooms[p] == IGNORE) {
+                continue;
+            }
+            int need = (p == start || p == end) ? 1 : 2;
+            int degree = __builtin_popcountll(duct->links[p]);
+            int used = __builtin_popcountll(forced[p]);
+
+            if (degree < need || used > need) {
+                return INVALID;
+            }
+            if (degree == need && used < need) {
+                // every link left is part of the duct.
+                for (ullong bits = duct->links[p] & ~forced[p]; bits; bits &= bits - 1) {
+                    int q = p + __builtin_ctzll(bits) - width;
+                    int a = reduce_find(parent, p);
+                    int b = reduce_find(parent, q);
+                    if (a == b) {
+                        // a loop of forced edges.
+                        return INVALID;
+                    }
+                    parent[a] = b;
+                    size[b] += size[a];
+                    forced[p] |= 1ULL << (q - p + width);
+                    forced[q] |= 1ULL << (p - q + width);
+                }
+                changed = 1;
+            } else if (used == need && degree > need) {
+                // the forced edges are all this room can take.
+                for (ullong bits = duct->links[p] & ~forced[p]; bits; bits &= bits - 1) {
+                    duct_cut_edge(duct, p, p + __builtin_ctzll(bits) - width);
+                }
+                changed = 1;
+            }
+        }
+
+        // a free link between two rooms of one forced chain closes a loop.
+        for (int p = 0; p < area; ++p) {
+            for (ullong bits = duct->links[p] & ~forced[p]; bits; bits &= bits - 1) {
+                int q = p + __builtin_ctzll(bits) - width;
+                if (q > p && reduce_find(parent, p) == reduce_find(parent, q)) {
+                    duct_cut_edge(duct, p, q);
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    int chain = reduce_find(parent, start);
+    if (chain == reduce_find(parent, end) && size[chain] < duct->max_length) {
+        // the intake and the AC are already joined, but some rooms are missed.
+        return INVALID;
+    }
+    return VALID;
+}
+
+/**
+ * Reduces the plan, marks it infeasible when no duct can exist and flags the
+ * corridor rooms, the ones left with exactly two links.
+ */
+static void duct_reduce(Duct* duct) {
+    int area = duct->width * duct->height;
+
+    duct->corridors = calloc(area, sizeof(uchar));
+    if (NULL == duct->corridors) {
+        duct_out_of_memory(duct);
+        return;
+    }
+
+    duct->infeasible = duct->start == UNDEFINED || duct->end == UNDEFINED ||
+        !duct_check_parity(duct) || !duct_reduce_edges(duct);
+    if (duct->infeasible) {
+        return;
+    }
+
+    for (int i = 0; i < area; ++i) {
+        if (duct->rooms[i] != IGNORE && i != duct->start && i != duct->end) {
+            duct->corridors[i] = __builtin_popcountll(duct->links[i]) == 2;
+        }
+    }
 }
 
 /**
  * Pushes a step into the path.
  */
-void duct_push(Duct* duct, Step* step) {
-    if (duct->mask[step->position] == 0) {
-        step->next = duct->tip;
-        duct->mask[step->position] = 1;
-        duct->tip = step;
+static void duct_push(Duct* duct, ushort position) {
+    int bit = position + duct->width;
+    if (!board_test(duct->board, bit)) {
+        board_set(duct->board, bit);
+        duct->path[duct->length++] = position;
         duct->delta -= 1;
     }
 }
 
 /**
- * Pops a step from the path.
+ * Pops a step from the path, returns its position.
  */
-Step* duct_pop(Duct* duct) {
-    Step* step = duct->tip;
-    if (NULL != step) {
-        duct->mask[step->position] = 0;
-        duct->tip = step->next;
-        duct->delta += 1;
-        step->next = NULL;
-        return step;
-    } else {
-        return NULL;
-    }
+static ushort duct_pop(Duct* duct) {
+    ushort position = duct->path[--duct->length];
+    board_clear(duct->board, position + duct->width);
+    duct->delta += 1;
+    return position;
 }
 
-Duct* duct_init() {
+/**
+ * Allocates a duct with no plan yet.
+ */
+static Duct* duct_new() {
     Duct* duct = malloc(sizeof(Duct));
     if (NULL != duct) {
         duct->width = 0;
         duct->height = 0;
-        duct->tip = NULL;
+        duct->length = 0;
         duct->start = UNDEFINED;
         duct->end = UNDEFINED;
-        duct->mask = NULL;
+        duct->special = 0;
         duct->rooms = NULL;
+        duct->links = NULL;
+        duct->sides = NULL;
+        duct->corridors = NULL;
+        duct->infeasible = 0;
+        duct->tasks = NULL;
+        duct->memo = NULL;
+        duct->list = NULL;
+        duct->checkpoint = NULL;
+        duct->transposed = 0;
+        duct->weights = NULL;
+        duct->deadline = 0;
+        duct->expired = 0;
+        duct->failure = NULL;
+        duct->status = AC_OK;
+        duct->error = NULL;
+#ifdef DUCT_STATS
+        memset(&duct->stats, 0, sizeof(Stats));
+#endif
+    }
+    return duct;
+}
 
-        duct_read(duct);
+static Duct* duct_init(Input* input) {
+    Duct* duct = duct_new();
+    if (NULL != duct && duct_read(duct, input) && duct->start != UNDEFINED) {
+        duct_push(duct, duct->start);
+    }
+    return duct;
+}
 
-        Step* step = step_init(duct->start);
-        if (NULL != step) {
-            duct_push(duct, step);
-        }
+/**
+ * Like duct_init, from a plan already read.  Takes over its values.
+ */
+static Duct* duct_init_plan(Plan* plan) {
+    Duct* duct = duct_new();
+    if (NULL != duct && duct_load(duct, plan) && duct->start != UNDEFINED) {
+        duct_push(duct, duct->start);
     }
     return duct;
 }
 
-void duct_destroy(Duct* duct) {
+static void duct_destroy(Duct* duct) {
     if (NULL != duct) {
-        Step* step = NULL;
-        while(NULL != (step = duct_pop(duct))) {
-            step_destroy(step);
-        }
-        free(duct->mask);
         free(duct->rooms);
+        free(duct->links);
+        free(duct->sides);
+        free(duct->corridors);
+        free(duct->weights);
         free(duct);
         duct = NULL;
     }
 }
 
-void duct_show(Duct* duct) {
-    uchar area = duct->width * duct->height;
+/**
+ * Makes an independent copy of the problem and its current path.
+ * The search state is a flat part of the struct, only the tables need copying.
+ */
+static Duct* duct_copy(Duct* duct) {
+    Duct* copy = malloc(sizeof(Duct));
+    if (NULL == copy) {
+        return NULL;
+    }
+    ushort area = duct->width * duct->height;
+    *copy = *duct;
+    copy->tasks = NULL;
+    copy->memo = NULL;
+    copy->list = NULL;
+    copy->checkpoint = NULL;
+    copy->weights = NULL;
+#ifdef DUCT_STATS
+    memset(&copy->stats, 0, sizeof(Stats));
+#endif
+    copy->rooms = malloc(sizeof(RoomType) * area);
+    copy->links = malloc(sizeof(ullong) * area);
+    copy->sides = malloc(sizeof(ullong) * area);
+    copy->corridors = malloc(sizeof(uchar) * area);
+    if (NULL == copy->rooms || NULL == copy->links || NULL == copy->sides || NULL == copy->corridors) {
+        duct_destroy(copy);
+        return NULL;
+    }
+    memcpy(copy->rooms, duct->rooms, sizeof(RoomType) * area);
+    memcpy(copy->links, duct->links, sizeof(ullong) * area);
+    memcpy(copy->sides, duct->sides, sizeof(ullong) * area);
+    memcpy(copy->corridors, duct->corridors, sizeof(uchar) * area);
+    return copy;
+}
+
+COMMAND void duct_show(Duct* duct) {
+    ushort area = duct->width * duct->height;
     char p[area];
-    uchar i = 0;
+    ushort i = 0;
     while (i < area) {
         p[i++] = ' ';
     }
 
-    Step* step = duct->tip;
-    Step* prev = NULL;
-
-    while (NULL != step) {
-        p[step->position] = step_dir(step, prev, duct->width);
-        prev = step;
-        step = step->next;
+    for (ushort k = 0; k < duct->length; ++k) {
+        if (k + 1 < duct->length) {
+            p[duct->path[k]] = step_dir(duct->path[k], duct->path[k + 1], duct->width);
+        } else {
+            p[duct->path[k]] = '*';
+        }
     }
     printf("---- \n");
     i = 0;
@@ -292,225 +1039,55 @@ void duct_show(Duct* duct) {
     }
 }
 
-int duct_search(Duct* duct);
-
-int duct_next(Duct* duct, uchar i) {
-    uchar delta = duct->delta;
-    uchar end = duct->end;
-
-    if (duct->mask[i] || (delta >> 1 && i == end)) {
-        // room[i] is visited or we do not own the room or
-        // room[i] is the end_room but we still need to cover more rooms.
-        // (delta >> 1) means we are 2 or more steps away.
-        return 0;
-    } else if (delta == 1 && i == end) {
-        // we have a solution
-        return 1;
-    } else {
-        // we need to recursively drill down
-        int result = 0;
-        Step* step = step_init(i);
-        if (NULL != step) {
-            duct_push(duct, step);
-            result = duct_search(duct);
-            step = duct_pop(duct);
-            step_destroy(step);
-        }
-        return result;
-    }
-}
+static bool task_list_add(TaskList* list, Duct* duct, ushort position);
+static bool list_add(List* list, Duct* duct);
+static bool half_map_add(HalfMap* map, const ullong* key, ullong count);
 
 /**
  * Checks to see if the end position is completely covered/blocked.  
  */
-bool duct_check_end(Duct* duct) {
+static bool duct_check_end(Duct* duct) {
 
     if (!(duct->delta >> 1)) {
         return VALID;
     }
 
-    uchar* mask = duct->mask;
-    uchar width = duct->width;
-    uchar end_room = duct->end;
+    ushort end_room = duct->end;
+    ullong open = ~board_window(duct->board, end_room) & duct->links[end_room];
 
-    RoomType room_type = duct->rooms[end_room];
+    return open ? VALID : INVALID;
+}
 
-    switch(room_type) {
+/**
+ * Checks if the specified room is a dead end.
+ */
+static bool duct_check_dead_end(Duct* duct, ushort position) {
 
-        case BASIC:
-            if (mask[end_room - 1] &&
-                mask[end_room - width] &&
-                mask[end_room + 1] &&
-                mask[end_room + width]) {
+    if (position == duct->end) {
+        // the room is the last room, where the mask count doesn't apply.
+        return VALID;
+    }
 
-                return INVALID;
-            }
-            break;
-        case TOP_EDGE:
-            if (mask[end_room - 1] &&
-                mask[end_room + 1] &&
-                mask[end_room + width]) {
-
-                return INVALID;
-            }
-            break;
-        case BOT_EDGE:
-            if (mask[end_room - 1] &&
-                mask[end_room - width] &&
-                mask[end_room + 1]) {
-
-                return INVALID;
-            }
-            break;
-        case LEF_EDGE:
-            if (mask[end_room - width] &&
-                mask[end_room + 1] &&
-                mask[end_room + width]) {
-
-                return INVALID;
-            }
-            break;
-        case RIG_EDGE:
-            if (mask[end_room - 1] &&
-                mask[end_room - width] &&
-                mask[end_room + width]) {
-
-                return INVALID;
-            }
-            break;
-        case TOP_LEFT:
-            if (mask[end_room + 1] &&
-                mask[end_room + width]) {
-
-                return INVALID;
-            }
-            break;
-        case TOP_RIGHT:
-            if (mask[end_room - 1] &&
-                mask[end_room + width]) {
-
-                return INVALID;
-            }
-            break;
-        case BOT_LEFT:
-            if (mask[end_room - width] &&
-                mask[end_room + 1]) {
-
-                return INVALID;
-            }
-            break;
-        case BOT_RIGHT:
-            if (mask[end_room - 1] &&
-                mask[end_room - width]) {
-
-                return INVALID;
-            }
-            break;
-        default:
-            break;
-    }
-    return VALID;
-}
-
-/**
- * Checks if the specified room is a dead end.
- */
-bool duct_check_dead_end(Duct* duct, uchar position) {
-
-    uchar* mask = duct->mask;
-
-    if (mask[position] || position == duct->end) {
-        // already visited or the room is the last room,
-        // where the mask count doesn't apply.
-        return VALID;
-    } else {
-        uchar exits = 0;
-        uchar top, bot, pre, nex;
-        uchar width = duct->width;
-
-        RoomType room_type = duct->rooms[position];
-
-        switch (room_type) {
-
-            case BASIC:
-                top = !mask[position - width];
-                bot = !mask[position + width];
-                pre = !mask[position - 1];
-                nex = !mask[position + 1];
-                exits = top + bot + pre + nex;
-                break;
-            case TOP_EDGE:
-                bot = !mask[position + width];
-                pre = !mask[position - 1];
-                nex = !mask[position + 1];
-                exits = bot + pre + nex;
-                break;
-            case LEF_EDGE:
-                top = !mask[position - width];
-                bot = !mask[position + width];
-                nex = !mask[position + 1];
-                exits = top + bot + nex;
-                break;
-            case RIG_EDGE:
-                top = !mask[position - width];
-                bot = !mask[position + width];
-                pre = !mask[position - 1];
-                exits = top + bot + pre;
-                break;
-            case BOT_EDGE:
-                top = !mask[position - width];
-                pre = !mask[position - 1];
-                nex = !mask[position + 1];
-                exits = top + pre + nex;
-                break;
-            case TOP_LEFT:
-                bot = !mask[position + width];
-                nex = !mask[position + 1];
-                exits = bot + nex;
-                break;
-            case BOT_LEFT:
-                top = !mask[position - width];
-                nex = !mask[position + 1];
-                exits = top + nex;
-                break;
-            case TOP_RIGHT:
-                bot = !mask[position + width];
-                pre = !mask[position - 1];
-                exits = bot + pre;
-                break;
-            case BOT_RIGHT:
-                top = !mask[position - width];
-                pre = !mask[position - 1];
-                exits = top + pre;
-                break;
-            default:
-                break;
-        }
-        if (exits >> 1) {
-            // exits >= 2
-            // There are 2 or more entry/exits for this room, OK.
-            return VALID;
-        } else {
-            // A neighbour cell has only one exit, 
-            // we just created a dead end.
-            return INVALID;
-        }
-    }
-}
+    ullong open = ~board_window(duct->board, position) & duct->links[position];
+    if (open & (open - 1)) {
+        // There are 2 or more entry/exits for this room, OK.
+        return VALID;
+    } else {
+        // A neighbour cell has only one exit, 
+        // we just created a dead end.
+        return INVALID;
+    }
+}
 
 /**
  * Checks if there are dead ends for all of the previous room's neighbour.
  */
-bool duct_check_previous_neighbor(Duct* duct) {
+KERNEL bool duct_check_previous_neighbor(Duct* duct, ushort width) {
 
-    Step* prev = duct->tip->next;
-    if (NULL == prev) {
+    if (duct->length < 2) {
         return VALID;
     }
-    uchar position = prev->position;
-
-    bool result = 0;
-    uchar width = duct->width;
+    ushort position = duct->path[duct->length - 2];
 
     // Consider this scenario where we just reached a room.
     //
@@ -520,83 +1097,62 @@ bool duct_check_previous_neighbor(Duct* duct) {
     // * * * ? ?
     // We just created a dead end for the room on the left hand side of the previous neighbour.
 
-    RoomType room_type = duct->rooms[position];
-    switch (room_type) {
+    // visited neighbours can not be dead ends, only test the open ones.
+    ullong open = ~board_window(duct->board, position) & duct->links[position];
+    for (; open; open &= open - 1) {
+        if (!duct_check_dead_end(duct, position + __builtin_ctzll(open) - width)) {
+            return INVALID;
+        }
+    }
+    return VALID;
+}
 
-        case BASIC:
-            result = 
-                duct_check_dead_end(duct, position - width) && 
-                duct_check_dead_end(duct, position + width) && 
-                duct_check_dead_end(duct, position - 1) &&
-                duct_check_dead_end(duct, position + 1); 
-            break;
-        case TOP_EDGE:
-            result = 
-                duct_check_dead_end(duct, position + width) &&
-                duct_check_dead_end(duct, position - 1) &&
-                duct_check_dead_end(duct, position + 1); 
-            break;
-        case LEF_EDGE:
-            result = 
-                duct_check_dead_end(duct, position - width) &&
-                duct_check_dead_end(duct, position + width) &&
-                duct_check_dead_end(duct, position + 1); 
-            break;
-        case RIG_EDGE:
-            result = 
-                duct_check_dead_end(duct, position - width) &&
-                duct_check_dead_end(duct, position + width) &&
-                duct_check_dead_end(duct, position - 1); 
-            break;
-        case BOT_EDGE:
-            result = 
-                duct_check_dead_end(duct, position - width) &&
-                duct_check_dead_end(duct, position - 1) &&
-                duct_check_dead_end(duct, position + 1); 
-            break;
-        case TOP_LEFT:
-            result = 
-                duct_check_dead_end(duct, position + width) &&
-                duct_check_dead_end(duct, position + 1); 
-            break;
-        case BOT_LEFT:
-            result = 
-                duct_check_dead_end(duct, position - width) &&
-                duct_check_dead_end(duct, position + 1); 
-            break;
-        case TOP_RIGHT:
-            result = 
-                duct_check_dead_end(duct, position + width) &&
-                duct_check_dead_end(duct, position - 1);
-            break;
-        case BOT_RIGHT:
-            result = 
-                duct_check_dead_end(duct, position - width) &&
-                duct_check_dead_end(duct, position - 1);
-            break;
-        default:
-            break;
+/**
+ * Checks the open neighbours of the tip.  One without any other exit could
+ * only be the next room and then a dead end.  One with a single other exit
+ * must be the next room, or it becomes a dead end once the tip moves on,
+ * so there can not be two of them.
+ *
+ * With duct_check_previous_neighbor this covers the exits of the whole
+ * board: moving the tip only takes exits from the rooms next to the tip
+ * and to the previous room, every other room keeps the two it had.
+ */
+KERNEL bool duct_check_tip_neighbor(Duct* duct, ushort width) {
+
+    ushort tip = duct->path[duct->length - 1];
+    ullong open = ~board_window(duct->board, tip) & duct->links[tip];
+    bool forced = 0;
+
+    for (; open; open &= open - 1) {
+        ushort position = tip + __builtin_ctzll(open) - width;
+        if (position == duct->end) {
+            continue;
+        }
+        ullong exits = ~board_window(duct->board, position) & duct->links[position];
+        if (!exits) {
+            return INVALID;
+        } else if (!(exits & (exits - 1))) {
+            if (forced) {
+                return INVALID;
+            }
+            forced = 1;
+        }
     }
-    return result;
+    return VALID;
 }
 
-bool duct_check_edge(Duct* duct) {
+static bool duct_check_edge(Duct* duct) {
 
     // special flag is true means the starting room is on an edge.
     if (!duct->special) {
         return VALID;
     }
     RoomType* rooms = duct->rooms;
-    uchar position = duct->tip->position;
-    uchar* mask = duct->mask;
-    uchar width = duct->width;
-
-    Step* prev = duct->tip->next;
-    if (NULL == prev) {
+    if (duct->length < 2) {
         return VALID;
     }
-
-    bool result = VALID;
+    ushort position = duct->path[duct->length - 1];
+    ushort prev = duct->path[duct->length - 2];
 
     // we reached an edge.
     //
@@ -616,121 +1172,4426 @@ bool duct_check_edge(Duct* duct) {
     // !1 (previous cell is a top-edge cell) || 
     // !2 (the cell to the left is visited or not ours (masked)) ||
     // !3 (the cell to the right is visited or not ours (masked));
-    switch (rooms[position]) {
+    //
+    // sides holds the two rooms along the edge, rooms we do not own are
+    // always set on the board.
+    return (rooms[prev] == rooms[position]) ||
+        (board_window(duct->board, position) & duct->sides[position]) != 0;
+}
 
-        case TOP_EDGE:
-            result = (rooms[prev->position] == TOP_EDGE) ||
-                mask[position - 1] ||  
-                mask[position + 1];
-            break;
-        case BOT_EDGE:
-            result = (rooms[prev->position] == BOT_EDGE) ||
-                mask[position - 1] || 
-                mask[position + 1];
-            break;
-        case LEF_EDGE:
-            result = (rooms[prev->position] == LEF_EDGE) ||
-                mask[position - width] || 
-                mask[position + width];
+/**
+ * Checks that the unvisited rooms can still be covered by a single duct
+ * running from the tip to the end.
+ *
+ * G is the graph of the unvisited rooms plus the tip.  A Hamiltonian path of
+ * G from the tip to the end survives the removal of any room v as at most two
+ * pieces, so:
+ *   - G - tip must be connected,
+ *   - G - end must be connected,
+ *   - G - v may fall into two components only if they separate the tip from the end.
+ * The cut vertices are found with an iterative Tarjan lowlink search from the tip.
+ */
+static bool duct_check_articulation(Duct* duct) {
+
+    ushort width = duct->width;
+    ushort tip = duct->path[duct->length - 1];
+    ushort end = duct->end;
+
+    ushort disc[MAX_AREA];      // discovery time of each room.
+    ushort low[MAX_AREA];       // lowest discovery time reachable through one back edge.
+    ushort finish[MAX_AREA];    // one past the last discovery time in the subtree.
+    ushort cuts[MAX_AREA];      // number of subtrees a room separates from the tip.
+    ushort stack[MAX_AREA];
+    ullong exits[MAX_AREA];
+    ullong seen[BOARD_WORDS] = { 0 };
+
+    // the tip is a room of G too.
+    board_clear(duct->board, tip + width);
+
+    bool result = VALID;
+    int size = 0;
+    ushort time = 0;
+    uchar children = 0;
+
+    stack[size++] = tip;
+    board_set(seen, tip + width);
+    disc[tip] = low[tip] = time++;
+    cuts[tip] = 0;
+    exits[tip] = ~board_window(duct->board, tip) & duct->links[tip];
+
+    while (size && result) {
+        ushort v = stack[size - 1];
+
+        if (exits[v]) {
+            ushort w = v + __builtin_ctzll(exits[v]) - width;
+            exits[v] &= exits[v] - 1;
+
+            if (!board_test(seen, w + width)) {
+                board_set(seen, w + width);
+                disc[w] = low[w] = time++;
+                cuts[w] = 0;
+                exits[w] = ~board_window(duct->board, w) & duct->links[w];
+                stack[size++] = w;
+            } else if (disc[w] < low[v]) {
+                // a back edge, the edge to the parent can only lower low to disc[parent],
+                // which never marks the parent as a cut on its own.
+                low[v] = disc[w];
+            }
+            continue;
+        }
+
+        finish[v] = time;
+        if (--size == 0) {
             break;
-        case RIG_EDGE:
-            result = (rooms[prev->position] == RIG_EDGE) ||
-                mask[position - width] || 
-                mask[position + width];
+        }
+
+        ushort p = stack[size - 1];
+        if (low[v] < low[p]) {
+            low[p] = low[v];
+        }
+        if (p == tip) {
+            // G - tip must be connected, the tip may only have one subtree.
+            if (++children > 1) {
+                result = INVALID;
+            }
+        } else if (low[v] >= disc[p]) {
+            // p separates the subtree of v from the tip.
+            bool has_end = board_test(seen, end + width) &&
+                disc[v] <= disc[end] && disc[end] < finish[v];
+            if (p == end || ++cuts[p] > 1 || !has_end) {
+                result = INVALID;
+            }
+        }
+    }
+
+    if (result && time != duct->delta + 1) {
+        // some unvisited rooms can not be reached from the tip.
+        result = INVALID;
+    }
+
+    board_set(duct->board, tip + width);
+    return result;
+}
+
+/**
+ * Checks if moving to the tip may have split the unvisited rooms.
+ *
+ * Looking at the ring of eight rooms around the tip, its open neighbours
+ * are still connected to each other if the diagonal room between two
+ * adjacent ones is open too.  Only when they fall into two or more groups
+ * can the move have cut the unvisited rooms apart, and only then the
+ * full articulation check is run.
+ */
+KERNEL bool duct_check_split(Duct* duct, ushort width) {
+
+    if (duct->delta < 2) {
+        return VALID;
+    }
+
+    int tip = duct->path[duct->length - 1];
+    ullong* board = duct->board;
+    ullong open = ~board_window(board, tip) & duct->links[tip];
+
+    bool up    = (open >> 0) & 1;
+    bool left  = (open >> (width - 1)) & 1;
+    bool right = (open >> (width + 1)) & 1;
+    bool down  = (open >> (width << 1)) & 1;
+
+    // rooms are at bit position + width, diagonals are two rows apart from the tip.
+    int groups = up + left + right + down;
+    groups -= up && right && !board_test(board, tip + 1);
+    groups -= right && down && !board_test(board, tip + (width << 1) + 1);
+    groups -= down && left && !board_test(board, tip + (width << 1) - 1);
+    groups -= left && up && !board_test(board, tip - 1);
+
+    if (groups < 2) {
+        return VALID;
+    }
+    return duct_check_articulation(duct);
+}
+
+/**
+ * Runs the checks on the room just reached and lines up its moves.
+ */
+KERNEL bool duct_enter_width(Duct* duct, ushort width) {
+
+    STAT(duct, nodes[duct->length - 1]);
+    if (!duct_check_previous_neighbor(duct, width)) {
+        STAT(duct, previous_neighbor);
+        return INVALID;
+    } else if (!duct_check_tip_neighbor(duct, width)) {
+        STAT(duct, tip_neighbor);
+        return INVALID;
+    } else if (!duct_check_end(duct)) {
+        STAT(duct, end);
+        return INVALID;
+    }
+
+    ushort top = duct->length - 1;
+    ushort position = duct->path[top];
+    if (duct->sides[position] && !duct_check_edge(duct)) {
+        // only edge rooms have sides.
+        STAT(duct, edge);
+        return INVALID;
+    } else if (!duct_check_split(duct, width)) {
+        STAT(duct, split);
+        return INVALID;
+    }
+
+    duct->moves[top] = ~board_window(duct->board, position) & duct->links[position];
+    return VALID;
+}
+
+static bool duct_enter(Duct* duct) {
+    return duct_enter_width(duct, duct->width);
+}
+
+/**
+ * Walks down a corridor from the room just entered: as long as the tip has
+ * only one way out, the next room is pushed without stopping for the checks.
+ * The end is left to the search and the checks run once the corridor is
+ * left behind.  The rooms walked through keep no moves, backtracking pops
+ * them one by one.
+ */
+KERNEL void duct_walk(Duct* duct, ullong result, ushort width) {
+    ushort top = duct->length - 1;
+    ushort position = duct->path[top];
+    bool walked = 0;
+
+    while (duct->corridors[position] && duct->moves[top]) {
+        ushort next = position + __builtin_ctzll(duct->moves[top]) - width;
+        if (next == duct->end) {
             break;
-        default:
+        }
+        duct->moves[top] = 0;
+        duct_push(duct, next);
+        top++;
+        position = next;
+        duct->counts[top] = result;
+        duct->moves[top] = ~board_window(duct->board, position) & duct->links[position];
+        walked = 1;
+        STAT(duct, walked);
+    }
+
+    if (walked && !duct_enter_width(duct, width)) {
+        duct->moves[top] = 0;
+    }
+}
+
+/**
+ * Memo related functions.
+ *
+ * The number of ways to finish a duct only depends on the rooms visited so
+ * far and on the tip, so the counts of finished subtrees are kept in a
+ * bounded transposition table.  A key is two independent 64-bit hashes of
+ * the bitboard and the tip: one picks the bucket, the other is stored with
+ * the remaining room count packed into its low 16 bits.  A bucket holds
+ * MEMO_WAYS entries, when it is full the entry with the fewest remaining
+ * rooms, the cheapest one to search again, is replaced.
+ */
+static ullong memo_mix(ullong x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static bool memo_init(Memo* memo, size_t bytes) {
+    size_t buckets = 1;
+    while ((buckets << 1) * sizeof(MemoEntry) * MEMO_WAYS <= bytes) {
+        buckets <<= 1;
+    }
+    memo->entries = calloc(buckets * MEMO_WAYS, sizeof(MemoEntry));
+    memo->mask = buckets - 1;
+    memo->hits = 0;
+    memo->misses = 0;
+    memo->stores = 0;
+    memo->evictions = 0;
+    return NULL != memo->entries;
+}
+
+static void memo_destroy(Memo* memo) {
+    free(memo->entries);
+    memo->entries = NULL;
+}
+
+/**
+ * Hashes the visited rooms and the tip into a bucket and a check value.
+ */
+static void memo_key(Duct* duct, ullong* bucket, ullong* check) {
+    ullong a = duct->path[duct->length - 1];
+    ullong b = a ^ 0x2545F4914F6CDD1DULL;
+    for (uchar i = 0; i < duct->words; ++i) {
+        a = memo_mix(a ^ duct->board[i]);
+        b = memo_mix(b + duct->board[i] + 0x9E3779B97F4A7C15ULL);
+    }
+    *bucket = a;
+    *check = (b & ~0xffffULL) | duct->delta;
+}
+
+static bool memo_find(Memo* memo, ullong bucket, ullong check, ullong* count) {
+    MemoEntry* entries = memo->entries + (bucket & memo->mask) * MEMO_WAYS;
+    for (int i = 0; i < MEMO_WAYS; ++i) {
+        if (entries[i].check == check) {
+            *count = entries[i].count;
+            memo->hits++;
+            return 1;
+        }
+    }
+    memo->misses++;
+    return 0;
+}
+
+static void memo_store(Memo* memo, ullong bucket, ullong check, ullong count) {
+    MemoEntry* entries = memo->entries + (bucket & memo->mask) * MEMO_WAYS;
+    MemoEntry* victim = entries;
+    for (int i = 0; i < MEMO_WAYS; ++i) {
+        if (entries[i].check == 0) {
+            victim = &entries[i];
             break;
+        }
+        if ((entries[i].check & 0xffff) < (victim->check & 0xffff)) {
+            victim = &entries[i];
+        }
     }
+    if (victim->check != 0) {
+        if ((victim->check & 0xffff) > (check & 0xffff)) {
+            // every entry covers a bigger subtree, keep them.
+            return;
+        }
+        memo->evictions++;
+    }
+    victim->check = check;
+    victim->count = count;
+    memo->stores++;
+}
 
-    return result;
+static void memo_report(Memo* memo) {
+    fprintf(stderr, "memo: %zu entries, %llu hits, %llu misses, %llu stores, %llu evictions\n",
+            (size_t) (memo->mask + 1) * MEMO_WAYS, memo->hits, memo->misses, memo->stores, memo->evictions);
+}
+
+#ifdef DUCT_STATS
+/**
+ * Statistics related functions.
+ */
+static void stats_merge(Stats* into, const Stats* from) {
+    for (int i = 0; i < MAX_AREA; ++i) {
+        into->nodes[i] += from->nodes[i];
+    }
+    into->previous_neighbor += from->previous_neighbor;
+    into->tip_neighbor += from->tip_neighbor;
+    into->end += from->end;
+    into->edge += from->edge;
+    into->split += from->split;
+    into->early_end += from->early_end;
+    into->walked += from->walked;
+}
+
+/**
+ * Writes the counters to stderr, one "stats:" line per group of key=value pairs.
+ */
+COMMAND void stats_report(const Stats* stats, long int search_ms) {
+    ullong nodes = 0;
+    for (int i = 0; i < MAX_AREA; ++i) {
+        nodes += stats->nodes[i];
+    }
+    fprintf(stderr, "stats: read_ms=%ld preprocess_ms=%ld search_ms=%ld\n",
+            stats->read_ms, stats->preprocess_ms, search_ms);
+    fprintf(stderr, "stats: nodes=%llu nodes_per_s=%.0f walked=%llu\n",
+            nodes, search_ms ? nodes * 1000.0 / search_ms : 0.0, stats->walked);
+    fprintf(stderr, "stats: rejected previous_neighbor=%llu tip_neighbor=%llu end=%llu edge=%llu split=%llu early_end=%llu\n",
+            stats->previous_neighbor, stats->tip_neighbor, stats->end, stats->edge, stats->split, stats->early_end);
+    for (int i = 0; i < MAX_AREA; ++i) {
+        if (stats->nodes[i]) {
+            fprintf(stderr, "stats: depth=%d nodes=%llu\n", i, stats->nodes[i]);
+        }
+    }
+}
+#endif
+
+/**
+ * Checkpoint related functions.
+ *
+ * The whole state of a running search is its path, the moves left and the
+ * counts at each path position and its result so far, plus the first moves
+ * left in duct_search_root.  Every CHECKPOINT_TICKS loop iterations the
+ * search looks at the clock and, once the interval has passed, writes that
+ * state to a new file that replaces the checkpoint file.  A resumed search
+ * rebuilds the path and goes on exactly where the checkpoint left off.
+ */
+static ullong checkpoint_fingerprint(Duct* duct) {
+    ullong hash = memo_mix(((ullong) duct->width << 48) | ((ullong) duct->height << 32) |
+                           ((ullong) duct->start << 16) | duct->end);
+    for (int i = 0; i < duct->width * duct->height; ++i) {
+        hash = memo_mix(hash ^ duct->links[i] ^ duct->rooms[i]);
+    }
+    return hash;
+}
+
+COMMAND void checkpoint_init(Checkpoint* checkpoint, const char* file, long int interval_ms, Duct* duct) {
+    memset(checkpoint, 0, sizeof(Checkpoint));
+    checkpoint->file = file;
+    checkpoint->interval_ms = interval_ms;
+    checkpoint->last_ms = clock_ms();
+    checkpoint->fingerprint = checkpoint_fingerprint(duct);
+}
+
+/**
+ * Writes the search state, base is where the running duct_search started.
+ */
+static void checkpoint_write(Checkpoint* checkpoint, Duct* duct, ushort base, ullong result) {
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", checkpoint->file);
+    FILE* file = fopen(temporary, "wb");
+    if (NULL == file) {
+        fprintf(stderr, "checkpoint: unable to write %s\n", temporary);
+        return;
+    }
+    ushort length = duct->length;
+    bool written =
+        fwrite(CHECKPOINT_MAGIC, 1, 8, file) == 8 &&
+        fwrite(&checkpoint->fingerprint, sizeof(ullong), 1, file) == 1 &&
+        fwrite(&checkpoint->root_moves, sizeof(ullong), 1, file) == 1 &&
+        fwrite(&checkpoint->root_result, sizeof(ullong), 1, file) == 1 &&
+        fwrite(&base, sizeof(ushort), 1, file) == 1 &&
+        fwrite(&length, sizeof(ushort), 1, file) == 1 &&
+        fwrite(&result, sizeof(ullong), 1, file) == 1 &&
+        fwrite(duct->path, sizeof(ushort), length, file) == length &&
+        fwrite(duct->moves, sizeof(ullong), length, file) == length &&
+        fwrite(duct->counts, sizeof(ullong), length, file) == length;
+    if (0 != fclose(file) || !written || 0 != rename(temporary, checkpoint->file)) {
+        fprintf(stderr, "checkpoint: unable to write %s\n", checkpoint->file);
+        remove(temporary);
+    }
+}
+
+/**
+ * Loads a checkpoint written for the same plan, the next search resumes it.
+ */
+COMMAND bool checkpoint_read(Checkpoint* checkpoint) {
+    FILE* file = fopen(checkpoint->file, "rb");
+    if (NULL == file) {
+        return INVALID;
+    }
+    char magic[8];
+    ullong fingerprint = 0;
+    bool valid =
+        fread(magic, 1, 8, file) == 8 && 0 == memcmp(magic, CHECKPOINT_MAGIC, 8) &&
+        fread(&fingerprint, sizeof(ullong), 1, file) == 1 && fingerprint == checkpoint->fingerprint &&
+        fread(&checkpoint->root_moves, sizeof(ullong), 1, file) == 1 &&
+        fread(&checkpoint->root_result, sizeof(ullong), 1, file) == 1 &&
+        fread(&checkpoint->base, sizeof(ushort), 1, file) == 1 &&
+        fread(&checkpoint->length, sizeof(ushort), 1, file) == 1 &&
+        checkpoint->base >= 1 && checkpoint->base <= checkpoint->length && checkpoint->length <= MAX_AREA &&
+        fread(&checkpoint->result, sizeof(ullong), 1, file) == 1 &&
+        fread(checkpoint->path, sizeof(ushort), checkpoint->length, file) == checkpoint->length &&
+        fread(checkpoint->moves, sizeof(ullong), checkpoint->length, file) == checkpoint->length &&
+        fread(checkpoint->counts, sizeof(ullong), checkpoint->length, file) == checkpoint->length;
+    fclose(file);
+    checkpoint->resumed = valid;
+    return valid;
+}
+
+/**
+ * Rebuilds the saved search state on top of the path the caller pushed,
+ * returns the base of the saved search and its result so far.
+ */
+static ushort checkpoint_restore(Checkpoint* checkpoint, Duct* duct, ullong* result) {
+    for (ushort i = duct->length; i < checkpoint->length; ++i) {
+        duct_push(duct, checkpoint->path[i]);
+    }
+    memcpy(duct->moves, checkpoint->moves, sizeof(ullong) * checkpoint->length);
+    memcpy(duct->counts, checkpoint->counts, sizeof(ullong) * checkpoint->length);
+    checkpoint->resumed = 0;
+    *result = checkpoint->result;
+    return checkpoint->base;
+}
+
+/**
+ * Called every CHECKPOINT_TICKS iterations of the search loop.
+ */
+static void checkpoint_tick(Checkpoint* checkpoint, Duct* duct, ushort base, ullong result) {
+    long int now = clock_ms();
+    if (now - checkpoint->last_ms >= checkpoint->interval_ms) {
+        checkpoint_write(checkpoint, duct, base, result);
+        checkpoint->last_ms = clock_ms();
+    }
 }
 
 /**
  * The main search algorithm starts here.
+ *
+ * Counts the ducts extending the current path.  The search is a loop over
+ * an explicit stack: every path position keeps the moves it has left to
+ * try, so the whole state lives in the Duct and nothing is allocated.
+ * With a memo, subtrees seen before are not searched again; a memo must
+ * not be used while cutting tasks, their counts would be missing.
  */
-int duct_search(Duct* duct) {
+KERNEL ullong duct_search_width(Duct* duct, ushort width) {
 
-    if (!duct_check_previous_neighbor(duct)) {
-        return 0;
-    } else if (!duct_check_end(duct)) {
+    ushort base = duct->length;
+    ushort end = duct->end;
+    Memo* memo = duct->memo;
+    Checkpoint* checkpoint = duct->checkpoint;
+    ullong result = 0;
+    ullong bucket = 0;
+    ullong check = 0;
+    ullong ticks = 0;
+
+    if (NULL != checkpoint && checkpoint->resumed) {
+        base = checkpoint_restore(checkpoint, duct, &result);
+    } else if (!duct_enter_width(duct, width)) {
         return 0;
     }
 
-    int result = 0;
-    uchar position = duct->tip->position;
-    uchar width = duct->width;
+    for (;;) {
+        if (!(++ticks & CHECKPOINT_TICKS)) {
+            if (NULL != checkpoint) {
+                checkpoint_tick(checkpoint, duct, base, result);
+            }
+            if (duct->deadline && clock_ms() > duct->deadline) {
+                // out of time, unwind the whole search.
+                duct->expired = 1;
+                memset(duct->moves + base - 1, 0, sizeof(ullong) * (duct->length - base + 1));
+            }
+        }
+        ushort top = duct->length - 1;
+        ullong moves = duct->moves[top];
 
-    RoomType room_type = duct->rooms[position];
-    switch (room_type) {
+        if (!moves) {
+            // every move from this room has been tried, backtrack.
+            if (duct->length == base) {
+                break;
+            }
+            if (NULL != memo && duct->delta >= MEMO_MIN_DELTA) {
+                memo_key(duct, &bucket, &check);
+                memo_store(memo, bucket, check, result - duct->counts[top]);
+            }
+            duct_pop(duct);
+            continue;
+        }
+        duct->moves[top] = moves & (moves - 1);
+        ushort i = duct->path[top] + __builtin_ctzll(moves) - width;
 
-        case BASIC:
-            result  = duct_next(duct, position - 1);
-            result += duct_next(duct, position + 1);
-            result += duct_next(duct, position - width);
-            result += duct_next(duct, position + width);
-            break;
-        case TOP_EDGE:
-            if (duct_check_edge(duct)) {
-                result  = duct_next(duct, position - 1);
-                result += duct_next(duct, position + 1);
-                result += duct_next(duct, position + width);
+        if (i == end) {
+            // room[i] is the end_room, it is a solution only if
+            // it is the last room to cover.
+            if (duct->delta == 1) {
+                result++;
+                if (NULL != duct->list && !list_add(duct->list, duct)) {
+                    // listed enough ducts, unwind the whole search.
+                    memset(duct->moves + base - 1, 0, sizeof(ullong) * (duct->length - base + 1));
+                }
+            } else {
+                STAT(duct, early_end);
             }
-            break;
-        case LEF_EDGE:
-            if (duct_check_edge(duct)) {
-                result  = duct_next(duct, position + 1);
-                result += duct_next(duct, position - width);
-                result += duct_next(duct, position + width);
+        } else if (NULL != duct->tasks && duct->length + 1 == duct->tasks->length) {
+            // deep enough, leave the rest of this subtree to a worker.
+            if (!task_list_add(duct->tasks, duct, i)) {
+                // no room for more, unwind the whole search.
+                memset(duct->moves + base - 1, 0, sizeof(ullong) * (duct->length - base + 1));
             }
-            break;
-        case RIG_EDGE:
-            if (duct_check_edge(duct)) {
-                result  = duct_next(duct, position - 1);
-                result += duct_next(duct, position - width);
-                result += duct_next(duct, position + width);
+        } else {
+            duct_push(duct, i);
+            if (!duct_enter_width(duct, width)) {
+                duct_pop(duct);
+                continue;
+            } else if (NULL != memo && duct->delta >= MEMO_MIN_DELTA) {
+                ullong count = 0;
+                memo_key(duct, &bucket, &check);
+                if (memo_find(memo, bucket, check, &count)) {
+                    result += count;
+                    duct_pop(duct);
+                    continue;
+                }
             }
-            break;
-        case BOT_EDGE:
-            if (duct_check_edge(duct)) {
-                result  = duct_next(duct, position - 1);
-                result += duct_next(duct, position + 1);
-                result += duct_next(duct, position - width);
+            duct->counts[top + 1] = result;
+            if (NULL == duct->tasks && duct->corridors[i]) {
+                duct_walk(duct, result, width);
             }
-            break;
-        case TOP_LEFT:
-            result  = duct_next(duct, position + 1);
-            result += duct_next(duct, position + width);
-            break;
-        case TOP_RIGHT:
-            result  = duct_next(duct, position - 1);
-            result += duct_next(duct, position + width);
-            break;
-        case BOT_LEFT:
-            result  = duct_next(duct, position + 1);
-            result += duct_next(duct, position - width);
-            break;
-        case BOT_RIGHT:
-            result  = duct_next(duct, position - 1);
-            result += duct_next(duct, position - width);
-            break;
-        default:
-            break;
+        }
     }
     return result; 
 }
 
-int main(int argc, char** argv) {
-    int result = 0;
+#define DUCT_SEARCH_KERNEL(W) \
+    static ullong duct_search_##W(Duct* duct) { return duct_search_width(duct, W); }
 
-    clock_t start = clock();
-    Duct* duct = duct_init();
-    if (NULL != duct) {
-        result = duct_search(duct);
+DUCT_SEARCH_KERNEL(4)
+DUCT_SEARCH_KERNEL(5)
+DUCT_SEARCH_KERNEL(6)
+DUCT_SEARCH_KERNEL(7)
+DUCT_SEARCH_KERNEL(8)
+DUCT_SEARCH_KERNEL(9)
+DUCT_SEARCH_KERNEL(10)
+DUCT_SEARCH_KERNEL(11)
+DUCT_SEARCH_KERNEL(12)
+DUCT_SEARCH_KERNEL(13)
+DUCT_SEARCH_KERNEL(14)
+DUCT_SEARCH_KERNEL(15)
+DUCT_SEARCH_KERNEL(16)
+
+/**
+ * Runs the kernel compiled for the width of duct, so the neighbour offsets
+ * in the hot loop are constants; other widths take the generic one.
+ */
+static ullong duct_search(Duct* duct) {
+    static ullong (*const kernels[])(Duct*) = {
+        duct_search_4, duct_search_5, duct_search_6, duct_search_7, duct_search_8,
+        duct_search_9, duct_search_10, duct_search_11, duct_search_12,
+        duct_search_13, duct_search_14, duct_search_15, duct_search_16
+    };
+    if (duct->width >= KERNEL_MIN_WIDTH && duct->width <= KERNEL_MAX_WIDTH) {
+        return kernels[duct->width - KERNEL_MIN_WIDTH](duct);
+    }
+    return duct_search_width(duct, duct->width);
+}
+
+/**
+ * Enumeration related functions.
+ *
+ * With a List set, every duct the search finds is written out as its moves
+ * from the intake, 2 bits each (0: up, 1: left, 2: right, 3: down), four
+ * moves per byte with the first move in the low bits.  The records follow
+ * a header of LIST_MAGIC and the intake column, row and number of moves
+ * as little endian 16-bit numbers.  As text, a duct is one line of "ulrd".
+ * Directions are those of the plan as read, even if it is stored transposed.
+ */
+/**
+ * xorshift64*, the random numbers of the sampling and of the estimator.
+ */
+static ullong random_next(ullong* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+COMMAND void list_init(List* list, ListMode mode, ullong limit, ullong seed, bool text, Duct* duct) {
+    list->mode = mode;
+    list->limit = limit;
+    list->found = 0;
+    list->written = 0;
+    list->text = text;
+    list->moves = duct->max_length - 1;
+    list->record = text ? list->moves + 1 : (list->moves + 3) >> 2;
+    list->transposed = duct->transposed;
+    list->random = seed * 0x9E3779B97F4A7C15ULL + 1;
+    list->size = 0;
+    list->buffer = malloc(LIST_BUFFER);
+    list->samples = mode == LIST_SAMPLE ? malloc((size_t) list->record * limit) : NULL;
+    if (NULL == list->buffer || (mode == LIST_SAMPLE && NULL == list->samples)) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+
+    if (!text) {
+        ushort x = duct->start % duct->width;
+        ushort y = duct->start / duct->width;
+        if (duct->transposed) {
+            ushort swap = x;
+            x = y;
+            y = swap;
+        }
+        uchar header[10] = {
+            LIST_MAGIC[0], LIST_MAGIC[1], LIST_MAGIC[2], LIST_MAGIC[3],
+            x & 0xff, x >> 8, y & 0xff, y >> 8, list->moves & 0xff, list->moves >> 8
+        };
+        fwrite(header, 1, sizeof(header), stdout);
+    }
+}
+
+static void list_flush(List* list) {
+    fwrite(list->buffer, 1, list->size, stdout);
+    list->size = 0;
+}
+
+/**
+ * Writes the sampled ducts and the rest of the buffer.
+ */
+COMMAND void list_destroy(List* list) {
+    if (list->mode == LIST_SAMPLE) {
+        ullong kept = list->found < list->limit ? list->found : list->limit;
+        for (ullong i = 0; i < kept; ++i) {
+            if (list->size + list->record > LIST_BUFFER) {
+                list_flush(list);
+            }
+            memcpy(list->buffer + list->size, list->samples + i * list->record, list->record);
+            list->size += list->record;
+            list->written++;
+        }
+    }
+    list_flush(list);
+    fflush(stdout);
+    free(list->buffer);
+    free(list->samples);
+    list->buffer = NULL;
+    list->samples = NULL;
+}
+
+/**
+ * Encodes the duct ending with the move from the tip to the end into record.
+ */
+static void list_encode(List* list, Duct* duct, uchar* record) {
+    static const char letters[] = "ulrd";
+    ushort width = duct->width;
+
+    if (!list->text) {
+        memset(record, 0, list->record);
+    }
+    for (ushort k = 1; k <= list->moves; ++k) {
+        ushort from = duct->path[k - 1];
+        ushort to = k < duct->length ? duct->path[k] : duct->end;
+        uchar move = to + width == from ? 0 : to + 1 == from ? 1 : to == from + 1 ? 2 : 3;
+        if (list->transposed) {
+            // up and left, right and down trade places.
+            move ^= 1;
+        }
+        if (list->text) {
+            record[k - 1] = letters[move];
+        } else {
+            record[(k - 1) >> 2] |= move << (((k - 1) & 3) << 1);
+        }
+    }
+    if (list->text) {
+        record[list->moves] = '\n';
+    }
+}
+
+/**
+ * Parses all, first:K, every:N or sample:K[:seed].
+ */
+COMMAND bool list_parse(const char* spec, ListMode* mode, ullong* limit, ullong* seed) {
+    static const char* names[] = { "all", "first:", "every:", "sample:" };
+    for (int m = LIST_ALL; m <= LIST_SAMPLE; ++m) {
+        size_t length = strlen(names[m]);
+        if (strncmp(spec, names[m], length)) {
+            continue;
+        }
+        *mode = m;
+        *limit = 0;
+        *seed = 1;
+        if (m == LIST_ALL) {
+            return spec[length] == '\0';
+        }
+        char* rest = NULL;
+        *limit = strtoull(spec + length, &rest, 10);
+        if (m == LIST_SAMPLE && *rest == ':') {
+            *seed = strtoull(rest + 1, &rest, 10);
+        }
+        return *limit > 0 && *rest == '\0';
+    }
+    return INVALID;
+}
+
+/**
+ * Hands a duct to the list, returns INVALID once no more are wanted.
+ */
+static bool list_add(List* list, Duct* duct) {
+    ullong found = list->found++;
+    uchar* record = NULL;
+
+    if (list->mode == LIST_SAMPLE) {
+        // reservoir sampling, every duct ends up kept with the same chance.
+        if (found < list->limit) {
+            record = list->samples + found * list->record;
+        } else {
+            ullong slot = random_next(&list->random) % (found + 1);
+            if (slot < list->limit) {
+                record = list->samples + slot * list->record;
+            }
+        }
+        if (NULL != record) {
+            list_encode(list, duct, record);
+        }
+        return VALID;
+    }
+
+    if (list->mode == LIST_EVERY && found % list->limit) {
+        return VALID;
+    }
+    if (list->size + list->record > LIST_BUFFER) {
+        list_flush(list);
+    }
+    list_encode(list, duct, list->buffer + list->size);
+    list->size += list->record;
+    list->written++;
+    return list->mode != LIST_FIRST || list->written < list->limit;
+}
+
+/**
+ * Symmetry related functions.
+ *
+ * A transform is one of the 8 symmetries of a rectangle: bit 2 transposes
+ * the grid, then bit 0 mirrors it left to right and bit 1 top to bottom.
+ */
+#define TRANSFORMS   8
+
+/**
+ * Maps a position through a transform, the width and height are the
+ * ones before the transform.
+ */
+static int transform_position(int position, uchar t, ushort width, ushort height) {
+    int x = position % width;
+    int y = position / width;
+    if (t & 4) {
+        int swap = x;
+        x = y;
+        y = swap;
+        swap = width;
+        width = height;
+        height = swap;
+    }
+    if (t & 1) {
+        x = width - 1 - x;
+    }
+    if (t & 2) {
+        y = height - 1 - y;
+    }
+    return y * width + x;
+}
+
+/**
+ * Finds the symmetries of the plan that keep the intake and the AC in place
+ * and groups the first moves out of the start into classes of moves that map
+ * onto each other.  Only the first move of a class gets a weight, the size of
+ * its class, the other moves get 0.  Nothing is set up if the plan has no
+ * symmetry besides the identity.
+ */
+static void duct_symmetry(Duct* duct) {
+    ushort width = duct->width;
+    ushort height = duct->height;
+    int area = width * height;
+    uchar group[TRANSFORMS];
+    uchar size = 0;
+
+    duct->weights = NULL;
+    if (duct->start == UNDEFINED || duct->end == UNDEFINED) {
+        return;
+    }
+
+    for (uchar t = 1; t < TRANSFORMS; ++t) {
+        if ((t & 4) && width != height) {
+            continue;
+        }
+        bool same = transform_position(duct->start, t, width, height) == duct->start &&
+            transform_position(duct->end, t, width, height) == duct->end;
+        for (int i = 0; same && i < area; ++i) {
+            int j = transform_position(i, t, width, height);
+            same = (duct->rooms[i] == IGNORE) == (duct->rooms[j] == IGNORE);
+        }
+        if (same) {
+            group[size++] = t;
+        }
+    }
+    if (!size) {
+        return;
+    }
+
+    duct->weights = calloc(area, sizeof(uchar));
+    if (NULL == duct->weights) {
+        // the search does without symmetry then.
+        return;
+    }
+
+    ushort start = duct->start;
+    uchar seen[MAX_AREA] = { 0 };
+    for (ullong open = duct->links[start]; open; open &= open - 1) {
+        ushort move = start + __builtin_ctzll(open) - width;
+        if (seen[move]) {
+            continue;
+        }
+        // the first move of a class stands for all of its images.
+        uchar count = 1;
+        seen[move] = 1;
+        for (uchar k = 0; k < size; ++k) {
+            ushort image = transform_position(move, group[k], width, height);
+            if (!seen[image]) {
+                seen[image] = 1;
+                count++;
+            }
+        }
+        duct->weights[move] = count;
+    }
+}
+
+/**
+ * Builds the canonical form of a plan: the smallest encoding over the 8
+ * transforms, with the intake and the AC swapped or not, since a duct
+ * read backwards is a duct too.  The key is the width, the height and a
+ * code per room (0: ours, 1: not ours, 2: intake, 3: AC); plans that are
+ * rotated or mirrored copies of each other share it.  Returns its length.
+ */
+static int duct_canonical(Duct* duct, ushort* key) {
+    ushort width = duct->width;
+    ushort height = duct->height;
+    int area = width * height;
+    int length = area + 2;
+    ushort candidate[MAX_AREA + 2];
+    bool found = 0;
+
+    for (uchar t = 0; t < TRANSFORMS; ++t) {
+        for (uchar swap = 0; swap < 2; ++swap) {
+            candidate[0] = (t & 4) ? height : width;
+            candidate[1] = (t & 4) ? width : height;
+            for (int i = 0; i < area; ++i) {
+                uchar code = 0;
+                if (duct->rooms[i] == IGNORE) {
+                    code = 1;
+                } else if (i == duct->start) {
+                    code = swap ? 3 : 2;
+                } else if (i == duct->end) {
+                    code = swap ? 2 : 3;
+                }
+                candidate[2 + transform_position(i, t, width, height)] = code;
+            }
+            if (!found || memcmp(candidate, key, sizeof(ushort) * length) < 0) {
+                memcpy(key, candidate, sizeof(ushort) * length);
+                found = 1;
+            }
+        }
+    }
+    return length;
+}
+
+/**
+ * Counts the ducts from the start, searching only one first move of
+ * every symmetry class and scaling its count by the size of the class.
+ */
+static ullong duct_search_root(Duct* duct) {
+    uchar* weights = duct->weights;
+    if (duct->infeasible) {
+        return 0;
+    }
+    Checkpoint* checkpoint = duct->checkpoint;
+    if (NULL == weights || duct->length != 1) {
+        return duct_search(duct);
+    }
+    if (!duct_enter(duct)) {
+        return 0;
+    }
+
+    ullong result = 0;
+    ullong moves = duct->moves[0];
+    ushort width = duct->width;
+    TaskList* tasks = duct->tasks;
+    if (NULL != checkpoint && checkpoint->resumed) {
+        // go on with the first move the checkpoint was taken in.
+        moves = checkpoint->root_moves;
+        result = checkpoint->root_result;
+    }
+    for (; moves; moves &= moves - 1) {
+        ushort i = duct->start + __builtin_ctzll(moves) - width;
+        uchar weight = weights[i];
+
+        if (!weight) {
+            // another move of the same class is searched instead.
+            continue;
+        } else if (i == duct->end) {
+            if (duct->delta == 1) {
+                result += weight;
+            }
+            continue;
+        }
+
+        if (NULL != tasks) {
+            tasks->weight = weight;
+            if (tasks->length == 2) {
+                if (!task_list_add(tasks, duct, i)) {
+                    break;
+                }
+                continue;
+            }
+        }
+        if (NULL != checkpoint) {
+            checkpoint->root_moves = moves;
+            checkpoint->root_result = result;
+        }
+        duct_push(duct, i);
+        result += weight * duct_search(duct);
+        duct_pop(duct);
+        if ((NULL != tasks && tasks->full) || duct->expired) {
+            break;
+        }
+    }
+    if (NULL != tasks) {
+        tasks->weight = 1;
+    }
+    return result;
+}
+
+/**
+ * Parallel search related functions.
+ */
+static void task_list_init(TaskList* list, ushort length) {
+    list->length = length;
+    list->size = 0;
+    list->capacity = 256;
+    list->paths = malloc(sizeof(ushort) * length * list->capacity);
+    list->weights = malloc(sizeof(uchar) * list->capacity);
+    list->weight = 1;
+    list->halves = NULL;
+    list->full = 0;
+    list->results = NULL;
+    if (NULL == list->paths || NULL == list->weights) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+}
+
+static void task_list_destroy(TaskList* list) {
+    free(list->paths);
+    free(list->weights);
+    free(list->results);
+    list->paths = NULL;
+    list->weights = NULL;
+    list->results = NULL;
+}
+
+/**
+ * Records the current path extended by position as a new task,
+ * returns INVALID if there is no room left for it.
+ */
+static bool task_list_add(TaskList* list, Duct* duct, ushort position) {
+    if (NULL != list->halves) {
+        ullong key[BOARD_WORDS + 1];
+        memcpy(key, duct->board, sizeof(ullong) * duct->words);
+        board_set(key, position + duct->width);
+        key[duct->words] = position;
+        if (!half_map_add(list->halves, key, list->weight)) {
+            list->full = 1;
+            return INVALID;
+        }
+        return VALID;
+    }
+    if (list->size == list->capacity) {
+        list->capacity <<= 1;
+        list->paths = realloc(list->paths, sizeof(ushort) * list->length * list->capacity);
+        list->weights = realloc(list->weights, sizeof(uchar) * list->capacity);
+        if (NULL == list->paths || NULL == list->weights) {
+            printf("Unable to allocate memory\n");
+            exit(1);
+        }
+    }
+    ushort* path = list->paths + list->size * list->length;
+    memcpy(path, duct->path, sizeof(ushort) * (list->length - 1));
+    path[list->length - 1] = position;
+    list->weights[list->size] = list->weight;
+    list->size++;
+    return VALID;
+}
+
+/**
+ * Searches the subtree below a recorded prefix, duct must hold the start only.
+ */
+static ullong duct_search_task(Duct* duct, ushort* path, ushort length) {
+    for (ushort i = 1; i < length; ++i) {
+        duct_push(duct, path[i]);
+    }
+    ullong result = duct_search(duct);
+    for (ushort i = 1; i < length; ++i) {
+        duct_pop(duct);
+    }
+    return result;
+}
+
+// The tasks owned by one worker, the owner takes from the tail, thieves from the head.
+typedef struct DequeStruct {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+} Deque;
+
+typedef struct PoolStruct {
+    Duct*     duct;
+    TaskList* tasks;
+    Deque*    deques;
+    int       threads;
+    size_t    memo_bytes;   // memory budget of each worker's memo, 0 for none.
+} Pool;
+
+typedef struct WorkerStruct {
+    Pool*     pool;
+    int       id;
+    pthread_t thread;
+    Memo      memo;
+    bool      expired;  // the worker gave up at the deadline of its duct.
+#ifdef DUCT_STATS
+    Stats     stats;
+#endif
+} Worker;
+
+static bool deque_pop_tail(Deque* deque, size_t* task) {
+    bool found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        *task = --deque->tail;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool deque_pop_head(Deque* deque, size_t* task) {
+    bool found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        *task = deque->head++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/**
+ * Takes the next task for a worker, stealing from the others when idle.
+ */
+static bool pool_take(Pool* pool, int id, size_t* task) {
+    if (deque_pop_tail(&pool->deques[id], task)) {
+        return 1;
+    }
+    for (int i = 1; i < pool->threads; ++i) {
+        if (deque_pop_head(&pool->deques[(id + i) % pool->threads], task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void* pool_work(void* arg) {
+    Worker* worker = arg;
+    Pool* pool = worker->pool;
+    TaskList* tasks = pool->tasks;
+    Duct* duct = duct_copy(pool->duct);
+    if (NULL == duct) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+
+    if (pool->memo_bytes) {
+        if (!memo_init(&worker->memo, pool->memo_bytes)) {
+            printf("Unable to allocate memory\n");
+            exit(1);
+        }
+        duct->memo = &worker->memo;
+    }
+
+    // a task may end before its first checkpoint, so the deadline is also checked between tasks.
+    size_t task = 0;
+    while (!duct->expired && pool_take(pool, worker->id, &task)) {
+        tasks->results[task] = duct_search_task(duct, tasks->paths + task * tasks->length, tasks->length);
+        if (duct->deadline && clock_ms() > duct->deadline) {
+            duct->expired = 1;
+        }
+    }
+    worker->expired = duct->expired;
+#ifdef DUCT_STATS
+    worker->stats = duct->stats;
+#endif
+    duct_destroy(duct);
+    return NULL;
+}
+
+/**
+ * Cuts the search tree at depth, returns the ducts shorter than that.
+ */
+static ullong duct_split(Duct* duct, TaskList* tasks, ushort depth) {
+    task_list_init(tasks, depth + 1);
+    duct->tasks = tasks;
+    ullong result = duct_search_root(duct);
+    duct->tasks = NULL;
+    return result;
+}
+
+/**
+ * Cuts the search tree for wanted tasks, a depth of 0 picks the first
+ * depth that gives at least that many.
+ */
+static ullong duct_split_tasks(Duct* duct, TaskList* tasks, ushort depth, size_t wanted) {
+    if (depth) {
+        return duct_split(duct, tasks, depth);
+    }
+    depth = 4;
+    ullong result = duct_split(duct, tasks, depth);
+    while (tasks->size < wanted && depth + 2 < duct->max_length / 2) {
+        task_list_destroy(tasks);
+        depth += 2;
+        result = duct_split(duct, tasks, depth);
+    }
+    return result;
+}
+
+/**
+ * Counts the ducts below a list of tasks on a work-stealing pool of threads,
+ * the memo budget is shared evenly between the workers.
+ */
+static ullong task_list_search(Duct* duct, TaskList* tasks, int threads, size_t memo_bytes) {
+    ullong result = 0;
+
+    tasks->results = calloc(tasks->size + 1, sizeof(ullong));
+    Deque* deques = malloc(sizeof(Deque) * threads);
+    Worker* workers = malloc(sizeof(Worker) * threads);
+    if (NULL == tasks->results || NULL == deques || NULL == workers) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+
+    Pool pool = { duct, tasks, deques, threads, memo_bytes / threads };
+    for (int i = 0; i < threads; ++i) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].head = tasks->size * i / threads;
+        deques[i].tail = tasks->size * (i + 1) / threads;
+    }
+    for (int i = 0; i < threads; ++i) {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        if (0 != pthread_create(&workers[i].thread, NULL, pool_work, &workers[i])) {
+            printf("Unable to start a worker thread\n");
+            exit(1);
+        }
+    }
+    Memo total = { NULL, 0, 0, 0, 0, 0 };
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        if (memo_bytes) {
+            total.mask += workers[i].memo.mask + 1;
+            total.hits += workers[i].memo.hits;
+            total.misses += workers[i].memo.misses;
+            total.stores += workers[i].memo.stores;
+            total.evictions += workers[i].memo.evictions;
+            memo_destroy(&workers[i].memo);
+        }
+    }
+    if (memo_bytes) {
+        total.mask--;
+        memo_report(&total);
+    }
+    // workers still running copy the duct and steal from every deque, so
+    // neither is touched before the last join.
+    for (int i = 0; i < threads; ++i) {
+        duct->expired |= workers[i].expired;
+#ifdef DUCT_STATS
+        stats_merge(&duct->stats, &workers[i].stats);
+#endif
+        pthread_mutex_destroy(&deques[i].lock);
+    }
+
+    for (size_t i = 0; i < tasks->size; ++i) {
+        result += tasks->results[i] * tasks->weights[i];
+    }
+    free(workers);
+    free(deques);
+    return result;
+}
+
+/**
+ * Counts the ducts on a work-stealing pool of threads.
+ * A depth of 0 picks one that gives every thread plenty of tasks.
+ */
+static ullong duct_search_parallel(Duct* duct, int threads, ushort depth, size_t memo_bytes) {
+    TaskList tasks;
+
+    if (duct->infeasible) {
+        return 0;
+    }
+    ullong result = duct_split_tasks(duct, &tasks, depth, (size_t) threads * 64);
+    result += task_list_search(duct, &tasks, threads, memo_bytes);
+    task_list_destroy(&tasks);
+    return result;
+}
+
+/**
+ * Estimation related functions.
+ *
+ * Knuth's estimator: a probe walks one random duct from the start, taking
+ * at every room one of the moves that pass the checks of the search,
+ * uniformly.  If it covers every room, the probe is worth the product of
+ * the number of choices along the way, else 0.  A duct is reached with
+ * probability 1 / its worth, so the mean worth over the probes is an
+ * unbiased estimate of the count.  The checks only cut moves that lead to
+ * no duct, they shrink the variance without biasing the estimate.
+ */
+typedef struct EstimatorStruct {
+    Duct*     duct;
+    pthread_t thread;
+    ullong    random;
+    ullong    samples;  // probes to run.
+    ullong    hits;     // probes that reached the AC.
+    double    mean;     // of the worth of the probes, updated as in Welford's method.
+    double    squares;  // sum of the squared deviations from the mean.
+} Estimator;
+
+/**
+ * Walks one random duct from the start and returns its worth,
+ * duct must hold the start only.
+ */
+static double duct_probe(Duct* duct, ullong* random) {
+    double worth = 1;
+    ushort end = duct->end;
+    ushort width = duct->width;
+
+    if (duct->infeasible || !duct_enter(duct)) {
+        return 0;
+    }
+    while (worth > 0) {
+        ushort top = duct->length - 1;
+        ushort choices[4];
+        ullong moves[4];
+        int size = 0;
+
+        for (ullong open = duct->moves[top]; open; open &= open - 1) {
+            ushort i = duct->path[top] + __builtin_ctzll(open) - width;
+            if (i == end) {
+                if (duct->delta == 1) {
+                    choices[size++] = i;
+                }
+                continue;
+            }
+            duct_push(duct, i);
+            if (duct_enter(duct)) {
+                moves[size] = duct->moves[top + 1];
+                choices[size++] = i;
+            }
+            duct_pop(duct);
+        }
+        if (!size) {
+            worth = 0;
+            break;
+        }
+
+        int pick = size > 1 ? random_next(random) % size : 0;
+        worth *= size;
+        if (choices[pick] == end) {
+            break;
+        }
+        duct_push(duct, choices[pick]);
+        duct->moves[top + 1] = moves[pick];
+    }
+    while (duct->length > 1) {
+        duct_pop(duct);
+    }
+    return worth;
+}
+
+static void* estimator_work(void* arg) {
+    Estimator* estimator = arg;
+    for (ullong n = 1; n <= estimator->samples; ++n) {
+        double worth = duct_probe(estimator->duct, &estimator->random);
+        double delta = worth - estimator->mean;
+        estimator->hits += worth > 0;
+        estimator->mean += delta / n;
+        estimator->squares += delta * (worth - estimator->mean);
+    }
+    return NULL;
+}
+
+/**
+ * Estimates the count of duct from samples probes spread over threads,
+ * returns the estimate and sets its standard error.  Every thread has its
+ * own random numbers drawn from seed, so a run can be repeated.
+ */
+COMMAND double duct_estimate(Duct* duct, ullong samples, ullong seed, int threads, double* error) {
+    Estimator* estimators = calloc(threads, sizeof(Estimator));
+    if (NULL == estimators) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    long int start = clock_ms();
+    for (int i = 0; i < threads; ++i) {
+        Estimator* estimator = &estimators[i];
+        estimator->duct = duct_copy(duct);
+        estimator->random = (seed + i) * 0x9E3779B97F4A7C15ULL + 1;
+        estimator->samples = samples / threads + ((ullong) i < samples % threads);
+        if (NULL == estimator->duct) {
+            printf("Unable to allocate memory\n");
+            exit(1);
+        }
+        if (0 != pthread_create(&estimator->thread, NULL, estimator_work, estimator)) {
+            printf("Unable to start a worker thread\n");
+            exit(1);
+        }
+    }
+
+    // Chan's merge of the per thread means and squared deviations.
+    double mean = 0;
+    double squares = 0;
+    ullong total = 0;
+    ullong hits = 0;
+    for (int i = 0; i < threads; ++i) {
+        Estimator* estimator = &estimators[i];
+        pthread_join(estimator->thread, NULL);
+        ullong n = estimator->samples;
+        if (n) {
+            double delta = estimator->mean - mean;
+            mean += delta * n / (total + n);
+            squares += estimator->squares + delta * delta * total * n / (total + n);
+            total += n;
+        }
+        hits += estimator->hits;
+        duct_destroy(estimator->duct);
+    }
+    free(estimators);
+
+    long int elapsed = clock_ms() - start;
+    *error = total > 1 ? sqrt(squares / (total - 1) / total) : 0;
+    fprintf(stderr, "estimate: %llu samples, %llu reached the AC, %.0f samples/s\n",
+            total, hits, total * 1000.0 / (elapsed ? elapsed : 1));
+    return mean;
+}
+
+/**
+ * Bidirectional search related functions.
+ *
+ * A duct of N rooms is a half of k rooms grown from the intake joined to a
+ * half of N - k rooms grown from the AC.  Both halves are enumerated with the
+ * usual search cut at their length and gathered by (visited rooms, tip); a
+ * half from the AC then only matches the halves from the intake that visited
+ * exactly the other rooms and stopped next to its tip.
+ */
+static void half_map_destroy(HalfMap* map) {
+    free(map->keys);
+    free(map->counts);
+    map->keys = NULL;
+    map->counts = NULL;
+}
+
+/**
+ * Allocates an empty map, INVALID if there is no memory for it.
+ */
+static bool half_map_init(HalfMap* map, uchar words, size_t bytes) {
+    map->stride = words + 1;
+    map->capacity = 1 << 10;
+    map->size = 0;
+    // every entry costs its key and count, twice over at the maximum load.
+    map->limit = bytes / ((map->stride + 1) * sizeof(ullong) * 2);
+    map->keys = malloc(sizeof(ullong) * map->stride * map->capacity);
+    map->counts = calloc(map->capacity, sizeof(ullong));
+    if (NULL == map->keys || NULL == map->counts) {
+        half_map_destroy(map);
+        return INVALID;
+    }
+    return VALID;
+}
+
+/**
+ * Finds the slot of a key, empty slots have a count of 0.
+ */
+static size_t half_map_slot(HalfMap* map, const ullong* key) {
+    ullong hash = 0;
+    for (uchar i = 0; i < map->stride; ++i) {
+        hash = memo_mix(hash ^ key[i]);
+    }
+    size_t mask = map->capacity - 1;
+    size_t slot = hash & mask;
+    while (map->counts[slot] &&
+           memcmp(map->keys + slot * map->stride, key, sizeof(ullong) * map->stride)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Adds count halves to a key, returns INVALID when the memory cap is hit.
+ */
+static bool half_map_add(HalfMap* map, const ullong* key, ullong count) {
+    size_t slot = half_map_slot(map, key);
+    if (!map->counts[slot]) {
+        if (map->size + 1 > map->limit) {
+            return INVALID;
+        }
+        if ((map->size + 1) << 1 > map->capacity) {
+            HalfMap bigger = *map;
+            bigger.capacity <<= 1;
+            bigger.size = 0;
+            bigger.keys = malloc(sizeof(ullong) * map->stride * bigger.capacity);
+            bigger.counts = calloc(bigger.capacity, sizeof(ullong));
+            if (NULL == bigger.keys || NULL == bigger.counts) {
+                half_map_destroy(&bigger);
+                return INVALID;
+            }
+            for (size_t i = 0; i < map->capacity; ++i) {
+                if (map->counts[i]) {
+                    half_map_add(&bigger, map->keys + i * map->stride, map->counts[i]);
+                }
+            }
+            half_map_destroy(map);
+            *map = bigger;
+            slot = half_map_slot(map, key);
+        }
+        memcpy(map->keys + slot * map->stride, key, sizeof(ullong) * map->stride);
+        map->size++;
+    }
+    map->counts[slot] += count;
+    return VALID;
+}
+
+static ullong half_map_find(HalfMap* map, const ullong* key) {
+    return map->counts[half_map_slot(map, key)];
+}
+
+/**
+ * Gathers the halves of the given length grown from the start of duct.
+ */
+static bool duct_halves(Duct* duct, HalfMap* map, ushort length) {
+    // the prefixes go to map, the list itself holds none.
+    TaskList tasks = { length, NULL, NULL, NULL, 1, map, 0, 0, 0 };
+    duct->tasks = &tasks;
+    duct_search_root(duct);
+    duct->tasks = NULL;
+    bool full = tasks.full;
+    task_list_destroy(&tasks);
+    return !full;
+}
+
+/**
+ * Counts the ducts by joining halves from the intake and from the AC.
+ * Falls back to the plain search when the halves do not fit in bytes.
+ */
+static ullong duct_search_bidirectional(Duct* duct, size_t bytes) {
+    if (duct->infeasible) {
+        return 0;
+    }
+    if (duct->max_length < 4) {
+        return duct_search_root(duct);
+    }
+
+    uchar words = duct->words;
+    ushort width = duct->width;
+    ushort forward = duct->max_length / 2;
+    ushort backward = duct->max_length - forward;
+
+    // the same plan searched from the AC back to the intake.
+    Duct* reverse = duct_copy(duct);
+    if (NULL == reverse) {
+        fprintf(stderr, "bidir: out of memory, falling back to the plain search\n");
+        return duct_search_root(duct);
+    }
+    duct_pop(reverse);
+    reverse->start = duct->end;
+    reverse->end = duct->start;
+    reverse->special = duct->rooms[reverse->start] != BASIC;
+    duct_push(reverse, reverse->start);
+
+    // maps without memory fall back to the plain search, as a full one does.
+    HalfMap from_start;
+    HalfMap from_end;
+    bool halves = half_map_init(&from_start, words, bytes / 2);
+    halves = half_map_init(&from_end, words, bytes / 2) && halves;
+
+    ullong result = 0;
+    halves = halves && duct_halves(duct, &from_start, forward) && !duct->expired &&
+             duct_halves(reverse, &from_end, backward);
+    duct->expired |= reverse->expired;
+    if (duct->expired) {
+        // halves given up at the deadline are partial, the count is dropped.
+    } else if (halves) {
+        // every room is visited by exactly one half, the rooms we do not own are set on both.
+        ullong all[BOARD_WORDS] = { 0 };
+        ullong ignore[BOARD_WORDS];
+        memcpy(ignore, duct->board, sizeof(ignore));
+        board_clear(ignore, duct->start + width);
+        for (int i = 0; i < width * duct->height; ++i) {
+            board_set(all, i + width);
+        }
+
+        ullong key[BOARD_WORDS + 1];
+        for (size_t slot = 0; slot < from_end.capacity; ++slot) {
+            if (!from_end.counts[slot]) {
+                continue;
+            }
+            ullong* half = from_end.keys + slot * from_end.stride;
+            ushort tip = half[words];
+            for (uchar i = 0; i < words; ++i) {
+                key[i] = ignore[i] | (all[i] & ~half[i]);
+            }
+            for (ullong open = duct->links[tip]; open; open &= open - 1) {
+                ushort other = tip + __builtin_ctzll(open) - width;
+                if (board_test(key, other + width)) {
+                    key[words] = other;
+                    result += half_map_find(&from_start, key) * from_end.counts[slot];
+                }
+            }
+        }
+        fprintf(stderr, "bidir: %zu halves from the intake, %zu from the AC\n",
+                from_start.size, from_end.size);
+    } else {
+        fprintf(stderr, "bidir: memory cap exceeded, falling back to the plain search\n");
+        result = duct_search_root(duct);
+    }
+
+    half_map_destroy(&from_start);
+    half_map_destroy(&from_end);
+#ifdef DUCT_STATS
+    stats_merge(&duct->stats, &reverse->stats);
+#endif
+    duct_destroy(reverse);
+    return result;
+}
+
+/**
+ * Count related functions.
+ *
+ * The number of ducts grows exponentially with the area and no longer fits
+ * 64 bits past about 8x8.  A Count holds it as little endian 64-bit limbs,
+ * size of them in use; sums wrap around modulo 2^(64 size), so the size only
+ * has to cover the final result.
+ */
+#define COUNT_LIMBS  32
+#define COUNT_PRIMES 36     // most residues of a modular count, no less than COUNT_LIMBS.
+
+typedef struct CountStruct {
+    ullong limbs[COUNT_LIMBS];
+    uchar  size;
+} Count;
+
+static void count_set(Count* count, ullong value) {
+    memset(count->limbs, 0, sizeof(count->limbs));
+    count->limbs[0] = value;
+    count->size = 1;
+}
+
+/**
+ * Adds the limbs words of value to sum.
+ */
+static void count_add(ullong* sum, const ullong* value, uchar limbs) {
+    ullong carry = 0;
+    for (uchar i = 0; i < limbs; ++i) {
+        ullong limb = sum[i] + carry;
+        carry = limb < carry;
+        limb += value[i];
+        carry += limb < value[i];
+        sum[i] = limb;
+    }
+}
+
+/**
+ * Adds the residues of value to sum, each modulo its prime below 2^63.
+ */
+static void count_add_mod(ullong* sum, const ullong* value, uchar lanes, const ullong* primes) {
+    for (uchar i = 0; i < lanes; ++i) {
+        ullong residue = sum[i] + value[i];
+        sum[i] = residue >= primes[i] ? residue - primes[i] : residue;
+    }
+}
+
+/**
+ * Writes a count in decimal, 9 digits at a time.  Returns INVALID if it
+ * does not fit in bytes with its terminating zero.
+ */
+static bool count_format(const Count* count, char* buffer, size_t bytes) {
+    ullong limbs[COUNT_LIMBS];
+    unsigned int digits[COUNT_LIMBS * 64 / 29 + 1]; // base 10^9, least significant first.
+    int size = count->size;
+    int length = 0;
+
+    memcpy(limbs, count->limbs, sizeof(ullong) * size);
+    do {
+        // divide by 10^9 in 32-bit halves so the remainder never overflows.
+        ullong rest = 0;
+        for (int i = size - 1; i >= 0; --i) {
+            ullong high = (rest << 32) | (limbs[i] >> 32);
+            rest = high % 1000000000ULL;
+            ullong low = (rest << 32) | (limbs[i] & 0xffffffffULL);
+            rest = low % 1000000000ULL;
+            limbs[i] = ((high / 1000000000ULL) << 32) | (low / 1000000000ULL);
+        }
+        digits[length++] = rest;
+        while (size > 0 && !limbs[size - 1]) {
+            size--;
+        }
+    } while (size > 0);
+
+    size_t at = snprintf(buffer, bytes, "%u", digits[--length]);
+    while (length > 0 && at < bytes) {
+        at += snprintf(buffer + at, bytes - at, "%09u", digits[--length]);
+    }
+    return at < bytes;
+}
+
+static void count_print(const Count* count) {
+    char buffer[AC_COUNT_DIGITS];
+    count_format(count, buffer, sizeof(buffer));
+    printf("%s\n", buffer);
+}
+
+// ceil(1024 log2(n)) for n choices.
+static const ushort log2_choices[] = { 0, 0, 1024, 1623, 2048 };
+
+/**
+ * How many limbs hold a count below 2^bits.
+ */
+static uchar count_limbs(ullong bits) {
+    ullong limbs = (bits + 63) >> 6;
+    return limbs < 1 ? 1 : limbs > COUNT_LIMBS ? COUNT_LIMBS : limbs;
+}
+
+/**
+ * How many bits the count of duct needs.  Every room but the AC leaves
+ * through one of its links, not the one it was entered by, so the number of
+ * ducts is at most links(intake) times the product of links - 1 elsewhere.
+ */
+static ullong duct_count_bits(Duct* duct) {
+    ullong bits = 0;
+
+    for (int i = 0; i < duct->width * duct->height; ++i) {
+        if (duct->rooms[i] == IGNORE || i == duct->end) {
+            continue;
+        }
+        int choices = __builtin_popcountll(duct->links[i]) - (i != duct->start);
+        if (choices > 1) {
+            bits += log2_choices[choices];
+        }
+    }
+    return (bits + 1023) >> 10;
+}
+
+static uchar duct_count_limbs(Duct* duct) {
+    return count_limbs(duct_count_bits(duct));
+}
+
+/**
+ * Frontier (broken-profile) dynamic programming.
+ *
+ * The grid is swept one cell at a time in row-major order.  The frontier
+ * between the processed and the unprocessed cells is crossed by at most
+ * width + 1 edges ("plugs"): plug x < column is the edge going down out of
+ * column x of the current row, plug column is the edge entering the current
+ * cell from the left and plugs above it are the edges going down out of the
+ * previous row.  Every plug takes 2 bits of the state key.
+ *
+ * A path segment with both ends on the frontier is written as a pair of
+ * brackets, a segment whose other end is the intake or the AC is written as
+ * PLUG_END.  Only one segment can hold each endpoint, so there are never more
+ * than two PLUG_END plugs and joining two of them completes the duct.
+ */
+#define PLUG_NONE    0
+#define PLUG_OPEN    1
+#define PLUG_CLOSE   2
+#define PLUG_END     3
+
+#define FRONTIER_MAX_WIDTH 31
+#define FRONTIER_RIGHT 1
+#define FRONTIER_DOWN  2
+#define STATE_EMPTY  (~0ULL)
+
+#define SPILL_MAX_RUNS 64     // runs merged at once, more are merged into one first.
+#define SPILL_BUFFER (1 << 16)
+
+// Sorted runs of frontier states a StateMap wrote to disk to stay in its budget.
+typedef struct SpillStruct {
+    const char* dir;        // where the run files go, they are unlinked at once.
+    size_t  budget;         // bytes the table of the map may take.
+    FILE*   runs[SPILL_MAX_RUNS];
+    int     size;           // runs written since the map was cleared.
+    int     heap[SPILL_MAX_RUNS]; // runs left to read, a min heap by their next key.
+    int     live;
+    ullong* heads;          // per run, the next key and count read from it.
+    ullong* merged;         // the count of the state spill_next returns.
+    ullong* order;          // keys and slots of the table, sorted to write a run.
+    size_t  order_size;
+    ullong  written;        // runs written, merges included.
+    ullong  bytes;          // bytes written to all runs.
+    const char* failure;    // why the runs can not be trusted, NULL if they can.
+    AcStatus status;        // how the library reports failure.
+} Spill;
+
+// An open addressing hash table of frontier states and their path counts.
+typedef struct StateMapStruct {
+    ullong* keys;
+    ullong* counts;     // limbs words per state, see Count.
+    uchar   limbs;
+    const ullong* primes; // when set, the words are residues modulo these primes instead.
+    Spill*  spill;      // when set, states past the budget go to disk.
+    size_t  size;       // number of states in use.
+    size_t  capacity;   // always a power of 2.
+    bool    starved;    // true once the table could not grow, the states added since were dropped.
+} StateMap;
+
+/**
+ * Allocates an empty map, INVALID if there is no memory for it.
+ */
+static bool state_map_init(StateMap* map, size_t capacity, uchar limbs) {
+    map->keys = malloc(sizeof(ullong) * capacity);
+    map->counts = malloc(sizeof(ullong) * limbs * capacity);
+    map->limbs = limbs;
+    map->primes = NULL;
+    map->spill = NULL;
+    map->size = 0;
+    map->capacity = capacity;
+    map->starved = 0;
+    if (NULL == map->keys || NULL == map->counts) {
+        free(map->keys);
+        free(map->counts);
+        map->keys = NULL;
+        map->counts = NULL;
+        return INVALID;
+    }
+    memset(map->keys, 0xff, sizeof(ullong) * capacity);
+    return VALID;
+}
+
+static void state_map_destroy(StateMap* map) {
+    free(map->keys);
+    free(map->counts);
+    map->keys = NULL;
+    map->counts = NULL;
+}
+
+static void spill_reset(Spill* spill);
+
+static void state_map_clear(StateMap* map) {
+    if (NULL != map->spill) {
+        spill_reset(map->spill);
+    }
+    memset(map->keys, 0xff, sizeof(ullong) * map->capacity);
+    map->size = 0;
+}
+
+static size_t state_map_slot(StateMap* map, ullong key) {
+    ullong hash = key * 0x9E3779B97F4A7C15ULL;
+    size_t mask = map->capacity - 1;
+    size_t slot = (size_t) (hash >> 17) & mask;
+    while (map->keys[slot] != STATE_EMPTY && map->keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void state_map_add(StateMap* map, ullong key, const ullong* count);
+static void spill_run(StateMap* map);
+
+/**
+ * Adds the limbs words of value to sum, as residues if primes are set.
+ */
+static void state_count_add(ullong* sum, const ullong* value, uchar limbs, const ullong* primes) {
+    if (NULL != primes) {
+        count_add_mod(sum, value, limbs, primes);
+    } else {
+        count_add(sum, value, limbs);
+    }
+}
+
+static void state_map_grow(StateMap* map) {
+    StateMap bigger;
+    if (!state_map_init(&bigger, map->capacity << 1, map->limbs)) {
+        map->starved = 1;
+        return;
+    }
+    bigger.primes = map->primes;
+    bigger.spill = map->spill;
+    for (size_t i = 0; i < map->capacity; ++i) {
+        if (map->keys[i] != STATE_EMPTY) {
+            state_map_add(&bigger, map->keys[i], map->counts + i * map->limbs);
+        }
+    }
+    state_map_destroy(map);
+    *map = bigger;
+}
+
+/**
+ * Adds count paths to the given state, inserting it if needed.
+ */
+static void state_map_add(StateMap* map, ullong key, const ullong* count) {
+    size_t slot = state_map_slot(map, key);
+    uchar limbs = map->limbs;
+    if (map->keys[slot] == STATE_EMPTY) {
+        if ((map->size + 1) << 1 > map->capacity) {
+            if (NULL != map->spill && (map->capacity << 1) * sizeof(ullong) * (map->limbs + 2) > map->spill->budget) {
+                // doubling would pass the budget, write the table out instead.
+                spill_run(map);
+            } else {
+                state_map_grow(map);
+            }
+            if (map->starved) {
+                // the sweep gives up on the map after this cell.
+                return;
+            }
+            slot = state_map_slot(map, key);
+        }
+        map->keys[slot] = key;
+        memset(map->counts + slot * limbs, 0, sizeof(ullong) * limbs);
+        map->size++;
+    }
+    if (limbs == 1 && NULL == map->primes) {
+        // plans up to about 8x8, keep the plain 64-bit add.
+        map->counts[slot] += *count;
+    } else {
+        state_count_add(map->counts + slot * limbs, count, limbs, map->primes);
+    }
+}
+
+/**
+ * Spill related functions.
+ *
+ * A map with a Spill keeps its table within the budget: when the table would
+ * have to grow past it, its states are sorted by key and written to disk as
+ * a run, keys as deltas and every word as a base 128 varint, and the table
+ * starts over.  spill_finish writes the rest as one more run, after which
+ * state_map_next streams the runs back merged in key order, adding up the
+ * counts of a state found in several of them.  Files are only ever read and
+ * written sequentially.
+ */
+static void spill_init(Spill* spill, size_t budget, const char* dir, uchar limbs) {
+    memset(spill, 0, sizeof(Spill));
+    spill->dir = NULL != dir ? dir : "/tmp";
+    spill->budget = budget;
+    spill->status = AC_OK;
+    spill->heads = malloc(sizeof(ullong) * (limbs + 1) * SPILL_MAX_RUNS);
+    spill->merged = malloc(sizeof(ullong) * limbs);
+    if (NULL == spill->heads || NULL == spill->merged) {
+        spill->failure = "Unable to allocate memory";
+        spill->status = AC_NO_MEMORY;
+    }
+}
+
+/**
+ * Gives up the runs with status, the first failure is the one reported.
+ * The map goes on without writing or reading runs, its sweep gives up.
+ */
+static void spill_fail(Spill* spill, AcStatus status, const char* why) {
+    if (NULL == spill->failure) {
+        spill->failure = why;
+        spill->status = status;
+    }
+}
+
+/**
+ * Drops the runs, closing a run file also removes it.
+ */
+static void spill_reset(Spill* spill) {
+    for (int i = 0; i < spill->size; ++i) {
+        fclose(spill->runs[i]);
+    }
+    spill->size = 0;
+    spill->live = 0;
+}
+
+static void spill_destroy(Spill* spill) {
+    spill_reset(spill);
+    free(spill->heads);
+    free(spill->merged);
+    free(spill->order);
+    spill->heads = NULL;
+    spill->merged = NULL;
+    spill->order = NULL;
+}
+
+/**
+ * Creates a new run file, unlinked at once so nothing is left behind.
+ */
+static FILE* spill_open(Spill* spill) {
+    char* name = malloc(strlen(spill->dir) + 16);
+    if (NULL == name) {
+        spill_fail(spill, AC_NO_MEMORY, "Unable to allocate memory");
+        return NULL;
+    }
+    sprintf(name, "%s/ac-spill-XXXXXX", spill->dir);
+    int fd = mkstemp(name);
+    FILE* file = -1 != fd ? fdopen(fd, "w+b") : NULL;
+    if (-1 != fd) {
+        unlink(name);
+    }
+    free(name);
+    if (NULL == file) {
+        if (-1 != fd) {
+            close(fd);
+        }
+        spill_fail(spill, AC_IO_FAILED, "Unable to create a spill file.");
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, SPILL_BUFFER);
+    spill->written++;
+    return file;
+}
+
+// Run files belong to one thread, the unlocked stdio calls are enough.
+static void spill_put(Spill* spill, FILE* file, ullong value) {
+    while (value >= 0x80) {
+        putc_unlocked((int) (value & 0x7f) | 0x80, file);
+        value >>= 7;
+        spill->bytes++;
+    }
+    putc_unlocked((int) value, file);
+    spill->bytes++;
+}
+
+static bool spill_get(FILE* file, ullong* value) {
+    *value = 0;
+    for (int shift = 0; ; shift += 7) {
+        int c = getc_unlocked(file);
+        if (EOF == c) {
+            return INVALID;
+        }
+        *value |= (ullong) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return VALID;
+        }
+    }
+}
+
+static void spill_write(Spill* spill, FILE* file, ullong key, ullong previous, const ullong* count, uchar limbs) {
+    spill_put(spill, file, key - previous);
+    for (uchar i = 0; i < limbs; ++i) {
+        spill_put(spill, file, count[i]);
+    }
+}
+
+/**
+ * Reads the next state of a run into its head, INVALID at the end of the run.
+ */
+static bool spill_read(Spill* spill, int run, uchar limbs) {
+    ullong* head = spill->heads + run * (limbs + 1);
+    ullong delta;
+    if (!spill_get(spill->runs[run], &delta)) {
+        return INVALID;
+    }
+    head[0] += delta;
+    for (uchar i = 0; i < limbs; ++i) {
+        if (!spill_get(spill->runs[run], head + 1 + i)) {
+            spill_fail(spill, AC_IO_FAILED, "A spill file is truncated.");
+            return INVALID;
+        }
+    }
+    return VALID;
+}
+
+static void spill_sift(Spill* spill, int i, uchar limbs) {
+    int* heap = spill->heap;
+    const ullong* heads = spill->heads;
+    size_t stride = limbs + 1;
+    while (1) {
+        int least = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < spill->live && heads[heap[left] * stride] < heads[heap[least] * stride]) {
+            least = left;
+        }
+        if (right < spill->live && heads[heap[right] * stride] < heads[heap[least] * stride]) {
+            least = right;
+        }
+        if (least == i) {
+            return;
+        }
+        int swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
+
+/**
+ * Moves the run with the smallest key on to its next state.
+ */
+static void spill_advance(Spill* spill, uchar limbs) {
+    if (!spill_read(spill, spill->heap[0], limbs)) {
+        spill->heap[0] = spill->heap[--spill->live];
+    }
+    spill_sift(spill, 0, limbs);
+}
+
+/**
+ * Starts reading all runs from their first state.
+ */
+static void spill_rewind(StateMap* map) {
+    Spill* spill = map->spill;
+    uchar limbs = map->limbs;
+    spill->live = 0;
+    for (int i = 0; i < spill->size; ++i) {
+        if (0 != fflush(spill->runs[i]) || ferror(spill->runs[i])) {
+            spill_fail(spill, AC_IO_FAILED, "Unable to write a spill file.");
+        }
+        rewind(spill->runs[i]);
+        spill->heads[i * (limbs + 1)] = 0;
+        if (spill_read(spill, i, limbs)) {
+            spill->heap[spill->live++] = i;
+        }
+    }
+    for (int i = spill->live / 2 - 1; i >= 0; --i) {
+        spill_sift(spill, i, limbs);
+    }
+}
+
+/**
+ * Returns the next state of the merged runs, in key order.
+ */
+static bool spill_next(StateMap* map, ullong* key, const ullong** count) {
+    Spill* spill = map->spill;
+    uchar limbs = map->limbs;
+    size_t stride = limbs + 1;
+    if (!spill->live) {
+        return INVALID;
+    }
+    const ullong* head = spill->heads + spill->heap[0] * stride;
+    *key = head[0];
+    memcpy(spill->merged, head + 1, sizeof(ullong) * limbs);
+    spill_advance(spill, limbs);
+    while (spill->live && spill->heads[spill->heap[0] * stride] == *key) {
+        state_count_add(spill->merged, spill->heads + spill->heap[0] * stride + 1, limbs, map->primes);
+        spill_advance(spill, limbs);
+    }
+    *count = spill->merged;
+    return VALID;
+}
+
+/**
+ * Merges all runs into one, which keeps the open files and the fan-in of
+ * the merge bounded.
+ */
+static void spill_merge(StateMap* map) {
+    Spill* spill = map->spill;
+    FILE* file = spill_open(spill);
+    if (NULL == file) {
+        return;
+    }
+    ullong key;
+    ullong previous = 0;
+    const ullong* count;
+    spill_rewind(map);
+    while (spill_next(map, &key, &count)) {
+        spill_write(spill, file, key, previous, count, map->limbs);
+        previous = key;
+    }
+    spill_reset(spill);
+    spill->runs[spill->size++] = file;
+}
+
+static int spill_order(const void* a, const void* b) {
+    ullong x = *(const ullong*) a;
+    ullong y = *(const ullong*) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Writes the states of the table as a new run, sorted by key, and empties
+ * the table.
+ */
+static void spill_run(StateMap* map) {
+    Spill* spill = map->spill;
+    uchar limbs = map->limbs;
+    if (spill->size == SPILL_MAX_RUNS) {
+        spill_merge(map);
+    }
+    if (spill->order_size < map->size) {
+        free(spill->order);
+        spill->order_size = map->size;
+        spill->order = malloc(sizeof(ullong) * 2 * map->size);
+        if (NULL == spill->order) {
+            spill->order_size = 0;
+            spill_fail(spill, AC_NO_MEMORY, "Unable to allocate memory");
+        }
+    }
+    // a failed spill drops the states instead, with the runs left full.
+    FILE* file = NULL == spill->failure ? spill_open(spill) : NULL;
+    if (NULL == file) {
+        memset(map->keys, 0xff, sizeof(ullong) * map->capacity);
+        map->size = 0;
+        return;
+    }
+
+    // key and slot pairs, sorted by key.
+    size_t size = 0;
+    for (size_t slot = 0; slot < map->capacity; ++slot) {
+        if (map->keys[slot] != STATE_EMPTY) {
+            spill->order[2 * size] = map->keys[slot];
+            spill->order[2 * size + 1] = slot;
+            size++;
+        }
+    }
+    qsort(spill->order, size, sizeof(ullong) * 2, spill_order);
+
+    ullong previous = 0;
+    for (size_t i = 0; i < size; ++i) {
+        ullong key = spill->order[2 * i];
+        spill_write(spill, file, key, previous, map->counts + spill->order[2 * i + 1] * limbs, limbs);
+        previous = key;
+    }
+    spill->runs[spill->size++] = file;
+
+    // state_map_clear would drop the runs.
+    memset(map->keys, 0xff, sizeof(ullong) * map->capacity);
+    map->size = 0;
+}
+
+/**
+ * Ends the writing of a map.  If it spilled, the rest of its table becomes
+ * one more run and the map is read back from the runs.
+ */
+static void spill_finish(StateMap* map) {
+    if (NULL != map->spill && map->spill->size) {
+        if (map->size) {
+            spill_run(map);
+        }
+        spill_rewind(map);
+    }
+}
+
+/**
+ * Returns the states of a map one by one, from slot on in the table or
+ * merged from its runs if it spilled.
+ */
+static bool state_map_next(StateMap* map, size_t* slot, ullong* key, const ullong** count) {
+    if (NULL != map->spill && map->spill->size) {
+        return spill_next(map, key, count);
+    }
+    while (*slot < map->capacity) {
+        size_t i = (*slot)++;
+        if (map->keys[i] != STATE_EMPTY) {
+            *key = map->keys[i];
+            *count = map->counts + i * map->limbs;
+            return VALID;
+        }
+    }
+    return INVALID;
+}
+
+static uchar plug_get(ullong key, uchar i) {
+    return (key >> (i << 1)) & 3;
+}
+
+static ullong plug_set(ullong key, uchar i, uchar plug) {
+    return (key & ~(3ULL << (i << 1))) | ((ullong) plug << (i << 1));
+}
+
+/**
+ * Finds the PLUG_CLOSE matching the PLUG_OPEN at plug i.
+ */
+static uchar plug_close_of(ullong key, uchar i) {
+    int depth = 1;
+    while (depth) {
+        uchar plug = plug_get(key, ++i);
+        if (plug == PLUG_OPEN) {
+            depth++;
+        } else if (plug == PLUG_CLOSE) {
+            depth--;
+        }
+    }
+    return i;
+}
+
+/**
+ * Finds the PLUG_OPEN matching the PLUG_CLOSE at plug i.
+ */
+static uchar plug_open_of(ullong key, uchar i) {
+    int depth = 1;
+    while (depth) {
+        uchar plug = plug_get(key, --i);
+        if (plug == PLUG_CLOSE) {
+            depth++;
+        } else if (plug == PLUG_OPEN) {
+            depth--;
+        }
+    }
+    return i;
+}
+
+/**
+ * Turns the far end of the bracket at plug i into a PLUG_END,
+ * used when the near end reaches the intake or the AC.
+ */
+static ullong plug_terminate(ullong key, uchar i, uchar plug) {
+    if (plug == PLUG_OPEN) {
+        return plug_set(key, plug_close_of(key, i), PLUG_END);
+    } else {
+        return plug_set(key, plug_open_of(key, i), PLUG_END);
+    }
+}
+
+// The grid as seen by the frontier sweep, transposed if that makes it narrower.
+typedef struct FrontierStruct {
+    ushort width;
+    ushort height;
+    uchar* cells;       // 0: room, 1: not ours, 2: intake or AC.
+    uchar* edges;       // per cell, FRONTIER_RIGHT and FRONTIER_DOWN if that edge is left after preprocessing.
+    int    last;        // index of the last room in sweep order.
+} Frontier;
+
+static void frontier_destroy(Frontier* frontier) {
+    free(frontier->cells);
+    free(frontier->edges);
+    frontier->cells = NULL;
+    frontier->edges = NULL;
+}
+
+static bool frontier_init(Frontier* frontier, Duct* duct) {
+    bool transpose = duct->width > duct->height;
+    ushort width = transpose ? duct->height : duct->width;
+    ushort height = transpose ? duct->width : duct->height;
+
+    if (width > FRONTIER_MAX_WIDTH) {
+        duct_fail(duct, AC_BAD_ENGINE, "The grid is too wide for the frontier engine.");
+        return INVALID;
+    }
+    if (duct->infeasible) {
+        return INVALID;
+    }
+
+    frontier->width = width;
+    frontier->height = height;
+    frontier->cells = malloc(sizeof(uchar) * width * height);
+    frontier->edges = calloc(width * height, sizeof(uchar));
+    frontier->last = -1;
+    if (NULL == frontier->cells || NULL == frontier->edges) {
+        frontier_destroy(frontier);
+        duct_fail(duct, AC_NO_MEMORY, "Unable to allocate memory");
+        return INVALID;
+    }
+
+    for (int i = 0; i < width * height; ++i) {
+        int x = i % width;
+        int y = i / width;
+        int position = transpose ? x * duct->width + y : i;
+
+        if (duct->rooms[position] == IGNORE) {
+            frontier->cells[i] = 1;
+        } else {
+            frontier->cells[i] = (position == duct->start || position == duct->end) ? 2 : 0;
+            frontier->last = i;
+        }
+
+        // the edges of the reduced graph, in sweep coordinates.
+        int right = transpose ? position + duct->width : position + 1;
+        int down = transpose ? position + 1 : position + duct->width;
+        if (x + 1 < width && duct_has_edge(duct, position, right)) {
+            frontier->edges[i] |= FRONTIER_RIGHT;
+        }
+        if (y + 1 < height && duct_has_edge(duct, position, down)) {
+            frontier->edges[i] |= FRONTIER_DOWN;
+        }
+    }
+    return VALID;
+}
+
+// The states at the start of a row of the sweep, for a later sweep to resume from.
+typedef struct LayerStruct {
+    ullong  prefix;     // hash of the cells and edges swept before the row.
+    ullong* keys;       // NULL until a sweep got to the row.
+    ullong* counts;
+    size_t  size;
+} Layer;
+
+// The layers of every row of a grid, kept between sweeps by a Session.
+typedef struct LayersStruct {
+    Layer* rows;        // height + 1 of them, rows[0] is never used.
+    int    height;
+    uchar  limbs;
+    ullong swept;       // rows swept so far.
+} Layers;
+
+static void layers_init(Layers* layers, uchar limbs) {
+    layers->rows = NULL;
+    layers->height = 0;
+    layers->limbs = limbs;
+    layers->swept = 0;
+}
+
+static void layers_destroy(Layers* layers) {
+    for (int i = 0; NULL != layers->rows && i <= layers->height; ++i) {
+        free(layers->rows[i].keys);
+        free(layers->rows[i].counts);
+    }
+    free(layers->rows);
+    layers->rows = NULL;
+}
+
+/**
+ * Keeps the states of map as the layer of a row.
+ */
+static void layer_save(Layer* layer, StateMap* map, ullong prefix, uchar limbs) {
+    free(layer->keys);
+    free(layer->counts);
+    layer->keys = malloc(sizeof(ullong) * (map->size + 1));
+    layer->counts = malloc(sizeof(ullong) * limbs * (map->size + 1));
+    if (NULL == layer->keys || NULL == layer->counts) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    layer->prefix = prefix;
+    layer->size = 0;
+    size_t slot = 0;
+    ullong key;
+    const ullong* count;
+    while (state_map_next(map, &slot, &key, &count)) {
+        layer->keys[layer->size] = key;
+        memcpy(layer->counts + layer->size * limbs, count, sizeof(ullong) * limbs);
+        layer->size++;
+    }
+}
+
+/**
+ * Hashes the cells and edges of frontier before each row into prefix, and
+ * returns the last row whose layer was swept over the same cells, 0 if
+ * there is none.  The states at the start of a row only depend on the
+ * cells before it, so a sweep may resume from there.
+ */
+static int layers_resume(Layers* layers, const Frontier* frontier, ullong* prefix) {
+    ushort width = frontier->width;
+    if (layers->height != frontier->height) {
+        layers_destroy(layers);
+        layers->height = frontier->height;
+        layers->rows = calloc(layers->height + 1, sizeof(Layer));
+        if (NULL == layers->rows) {
+            printf("Unable to allocate memory\n");
+            exit(1);
+        }
+    }
+
+    prefix[0] = width;
+    for (int y = 0; y < frontier->height; ++y) {
+        ullong hash = prefix[y];
+        for (int i = y * width; i < (y + 1) * width; ++i) {
+            hash = memo_mix(hash ^ (frontier->cells[i] << 2 | frontier->edges[i]) ^ ((ullong) i << 8));
+        }
+        prefix[y + 1] = hash;
+    }
+
+    int row = frontier->last / width;
+    while (row > 0 && (NULL == layers->rows[row].keys || layers->rows[row].prefix != prefix[row])) {
+        row--;
+    }
+    return row;
+}
+
+/**
+ * Gives up the count of duct if map dropped states, for want of memory or
+ * of its spill files.
+ */
+static bool state_map_failed(Duct* duct, const StateMap* map) {
+    if (map->starved) {
+        duct_fail(duct, AC_NO_MEMORY, "Unable to allocate memory");
+    }
+    if (NULL != map->spill && NULL != map->spill->failure) {
+        duct_fail(duct, map->spill->status, map->spill->failure);
+    }
+    return NULL != duct->failure;
+}
+
+/**
+ * Counts the ducts by sweeping the grid with the frontier.  Counts are
+ * limbs words, or with primes the residues modulo limbs primes.  With
+ * spills, the two state maps use them to stay within their budgets.  With
+ * layers, the sweep resumes from the last row it still has the states of
+ * and keeps the states of the rows after.  Returns INVALID if the frontier
+ * engine can not sweep the grid, duct->failure tells why.
+ */
+static bool frontier_sweep(Duct* duct, uchar limbs, const ullong* primes, Spill* spills, Layers* layers, ullong* result) {
+
+    memset(result, 0, sizeof(ullong) * limbs);
+    Frontier frontier;
+    if (!frontier_init(&frontier, duct)) {
+        return duct->infeasible;
+    }
+
+    ushort width = frontier.width;
+    uchar* cells = frontier.cells;
+    // width + 1 plugs fill all 64 bits at FRONTIER_MAX_WIDTH, a shift by 64 would be undefined.
+    ullong row_mask = width + 1 < 32 ? (1ULL << ((width + 1) << 1)) - 1 : ~0ULL;
+    ullong one[COUNT_PRIMES];
+    for (uchar i = 0; i < limbs; ++i) {
+        // one in every residue, only in the low limb otherwise.
+        one[i] = NULL != primes || !i;
+    }
+
+    StateMap maps[2];
+    bool allocated = state_map_init(&maps[0], 1 << 10, limbs);
+    allocated = state_map_init(&maps[1], 1 << 10, limbs) && allocated;
+    if (!allocated) {
+        state_map_destroy(&maps[0]);
+        state_map_destroy(&maps[1]);
+        frontier_destroy(&frontier);
+        duct_fail(duct, AC_NO_MEMORY, "Unable to allocate memory");
+        return INVALID;
+    }
+    maps[0].primes = maps[1].primes = primes;
+    if (NULL != spills) {
+        maps[0].spill = &spills[0];
+        maps[1].spill = &spills[1];
+    }
+    StateMap* curr = &maps[0];
+    StateMap* next = &maps[1];
+
+    int begin = 0;
+    ullong* prefix = NULL;
+    if (NULL != layers) {
+        prefix = malloc(sizeof(ullong) * (frontier.height + 1));
+        if (NULL == prefix) {
+            printf("Unable to allocate memory\n");
+            exit(1);
+        }
+        int row = layers_resume(layers, &frontier, prefix);
+        layers->swept += frontier.last / width - row + 1;
+        begin = row * width;
+    }
+    if (begin) {
+        const Layer* layer = &layers->rows[begin / width];
+        for (size_t j = 0; j < layer->size; ++j) {
+            state_map_add(curr, layer->keys[j], layer->counts + j * limbs);
+        }
+    } else {
+        state_map_add(curr, 0, one);
+    }
+
+    for (int i = begin; i <= frontier.last; ++i) {
+        if (duct->deadline && clock_ms() > duct->deadline) {
+            duct->expired = 1;
+            break;
+        }
+        uchar x = i % width;
+        uchar cell = cells[i];
+        if (NULL != layers && x == 0 && i > begin) {
+            layer_save(&layers->rows[i / width], curr, prefix[i / width], limbs);
+        }
+        bool can_down  = frontier.edges[i] & FRONTIER_DOWN;
+        bool can_right = frontier.edges[i] & FRONTIER_RIGHT;
+
+        state_map_clear(next);
+        size_t slot = 0;
+        ullong key;
+        const ullong* count;
+        while (state_map_next(curr, &slot, &key, &count)) {
+
+            if (x == 0) {
+                // start of a new row, the right plug of the previous row is empty.
+                key = (key << 2) & row_mask;
+            }
+            uchar left = plug_get(key, x);
+            uchar up = plug_get(key, x + 1);
+            ullong rest = plug_set(plug_set(key, x, PLUG_NONE), x + 1, PLUG_NONE);
+
+            if (cell == 1) {
+                // a room we do not own, nothing may cross it.
+                if (!left && !up) {
+                    state_map_add(next, key, count);
+                }
+            } else if (cell == 2) {
+                // the intake or the AC, exactly one edge.
+                if (left && up) {
+                    continue;
+                } else if (!left && !up) {
+                    if (can_down) {
+                        state_map_add(next, plug_set(rest, x, PLUG_END), count);
+                    }
+                    if (can_right) {
+                        state_map_add(next, plug_set(rest, x + 1, PLUG_END), count);
+                    }
+                } else {
+                    uchar plug = left | up;
+                    uchar at = left ? x : x + 1;
+                    if (plug != PLUG_END) {
+                        state_map_add(next, plug_terminate(rest, at, plug), count);
+                    } else if (i == frontier.last && rest == 0) {
+                        state_count_add(result, count, limbs, primes);
+                    }
+                }
+            } else if (!left && !up) {
+                // a room we own, start a new segment going down and right.
+                if (can_down && can_right) {
+                    state_map_add(next, plug_set(plug_set(rest, x, PLUG_OPEN), x + 1, PLUG_CLOSE), count);
+                }
+            } else if (!left || !up) {
+                // continue the segment down or right.
+                uchar plug = left | up;
+                if (can_down) {
+                    state_map_add(next, plug_set(rest, x, plug), count);
+                }
+                if (can_right) {
+                    state_map_add(next, plug_set(rest, x + 1, plug), count);
+                }
+            } else if (left == PLUG_END && up == PLUG_END) {
+                // joins the intake and the AC, only valid if nothing is left.
+                if (i == frontier.last && rest == 0) {
+                    state_count_add(result, count, limbs, primes);
+                }
+            } else if (left == PLUG_END || up == PLUG_END) {
+                uchar at = (left == PLUG_END) ? x + 1 : x;
+                uchar plug = (left == PLUG_END) ? up : left;
+                state_map_add(next, plug_terminate(rest, at, plug), count);
+            } else if (left == PLUG_OPEN && up == PLUG_OPEN) {
+                state_map_add(next, plug_set(rest, plug_close_of(key, x + 1), PLUG_OPEN), count);
+            } else if (left == PLUG_CLOSE && up == PLUG_CLOSE) {
+                state_map_add(next, plug_set(rest, plug_open_of(key, x), PLUG_CLOSE), count);
+            } else if (left == PLUG_CLOSE && up == PLUG_OPEN) {
+                state_map_add(next, rest, count);
+            }
+            // left == PLUG_OPEN && up == PLUG_CLOSE would close a loop.
+        }
+
+        spill_finish(next);
+        if (state_map_failed(duct, curr) || state_map_failed(duct, next)) {
+            break;
+        }
+        StateMap* swap = curr;
+        curr = next;
+        next = swap;
+    }
+
+    state_map_destroy(&maps[0]);
+    state_map_destroy(&maps[1]);
+    frontier_destroy(&frontier);
+    free(prefix);
+    return NULL == duct->failure;
+}
+
+static Count frontier_count(Duct* duct) {
+    Count result;
+    count_set(&result, 0);
+    uchar limbs = duct_count_limbs(duct);
+    if (frontier_sweep(duct, limbs, NULL, NULL, NULL, result.limbs)) {
+        result.size = limbs;
+    }
+    return result;
+}
+
+/**
+ * The frontier engine with its state maps capped at bytes in total, the
+ * states past that spill to run files in dir.  Reports the runs, the bytes
+ * spilled and the peak resident set size, to size the machines for a plan.
+ */
+static Count frontier_count_external(Duct* duct, size_t bytes, const char* dir) {
+    Count result;
+    count_set(&result, 0);
+    uchar limbs = duct_count_limbs(duct);
+    Spill spills[2];
+    spill_init(&spills[0], bytes / 2, dir, limbs);
+    spill_init(&spills[1], bytes / 2, dir, limbs);
+    if (NULL != spills[0].failure || NULL != spills[1].failure) {
+        duct_fail(duct, AC_NO_MEMORY, "Unable to allocate memory");
+    } else if (frontier_sweep(duct, limbs, NULL, spills, NULL, result.limbs)) {
+        result.size = limbs;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "external: %llu runs, %llu bytes spilled, peak rss %ld kB\n",
+            spills[0].written + spills[1].written, spills[0].bytes + spills[1].bytes, usage.ru_maxrss);
+    spill_destroy(&spills[0]);
+    spill_destroy(&spills[1]);
+    return result;
+}
+
+/**
+ * Modular counting related functions.
+ *
+ * The frontier sweep runs on residues modulo primes just below 2^63: one
+ * native add and compare per prime instead of carries through the limbs.
+ * The primes are shared out between the threads and each thread sweeps the
+ * grid once, its primes as lanes of the counts.  The count is rebuilt from
+ * the residues with the Chinese remainder theorem in Garner's form.  Enough
+ * primes are used for their product to pass the bound of duct_count_bits,
+ * and one more checks the result: its residue must match the count rebuilt
+ * from the others.
+ */
+static const ullong count_primes[COUNT_PRIMES] = {
+    0x7fffffffffffffe7ULL, 0x7fffffffffffff5bULL, 0x7ffffffffffffefdULL,
+    0x7ffffffffffffed3ULL, 0x7ffffffffffffe89ULL, 0x7ffffffffffffe7dULL,
+    0x7ffffffffffffe79ULL, 0x7ffffffffffffe67ULL, 0x7ffffffffffffe37ULL,
+    0x7ffffffffffffe29ULL, 0x7ffffffffffffdfbULL, 0x7ffffffffffffdefULL,
+    0x7ffffffffffffddbULL, 0x7ffffffffffffd8dULL, 0x7ffffffffffffd77ULL,
+    0x7ffffffffffffd63ULL, 0x7ffffffffffffd39ULL, 0x7ffffffffffffd21ULL,
+    0x7ffffffffffffd11ULL, 0x7ffffffffffffcafULL, 0x7ffffffffffffc99ULL,
+    0x7ffffffffffffc85ULL, 0x7ffffffffffffc6dULL, 0x7ffffffffffffc0dULL,
+    0x7ffffffffffffbd3ULL, 0x7ffffffffffffbb9ULL, 0x7ffffffffffffb97ULL,
+    0x7ffffffffffffb65ULL, 0x7ffffffffffffb3bULL, 0x7ffffffffffffb2bULL,
+    0x7ffffffffffffb1fULL, 0x7ffffffffffffaefULL, 0x7ffffffffffffaedULL,
+    0x7ffffffffffffae3ULL, 0x7ffffffffffffab3ULL, 0x7ffffffffffffa8dULL
+};
+
+// The share of the primes swept by one thread.
+typedef struct ModularStruct {
+    Duct      duct;     // a copy sharing the tables, the deadline and failures are flagged on it.
+    pthread_t thread;
+    bool      started;  // false if the share runs on the calling thread.
+    const ullong* primes;
+    uchar     lanes;
+    bool      valid;
+    ullong    residues[COUNT_PRIMES];
+} Modular;
+
+/**
+ * a * b mod p for a, b < p < 2^63, by doubling.
+ */
+static ullong mul_mod(ullong a, ullong b, ullong p) {
+    ullong result = 0;
+    for (; b; b >>= 1) {
+        if (b & 1) {
+            result += a;
+            result -= result >= p ? p : 0;
+        }
+        a += a;
+        a -= a >= p ? p : 0;
+    }
+    return result;
+}
+
+/**
+ * The inverse of a modulo p, a and p coprime, by the extended Euclidean algorithm.
+ */
+static ullong inverse_mod(ullong a, ullong p) {
+    long long t = 0;
+    long long next_t = 1;
+    ullong r = p;
+    ullong next_r = a % p;
+    while (next_r) {
+        ullong q = r / next_r;
+        long long swap_t = t - (long long) q * next_t;
+        ullong swap_r = r - q * next_r;
+        t = next_t;
+        next_t = swap_t;
+        r = next_r;
+        next_r = swap_r;
+    }
+    return t < 0 ? (ullong) (t + (long long) p) : (ullong) t;
+}
+
+/**
+ * count = count * factor + addend, the 128-bit products in 32-bit halves.
+ */
+static void count_mul_add(Count* count, ullong factor, ullong addend) {
+    ullong carry = addend;
+    ullong f0 = factor & 0xffffffffULL;
+    ullong f1 = factor >> 32;
+    for (uchar i = 0; i < count->size; ++i) {
+        ullong l0 = count->limbs[i] & 0xffffffffULL;
+        ullong l1 = count->limbs[i] >> 32;
+        ullong low = l0 * f0;
+        ullong cross = l0 * f1;
+        ullong other = l1 * f0;
+        ullong middle = (low >> 32) + (cross & 0xffffffffULL) + (other & 0xffffffffULL);
+        ullong high = l1 * f1 + (cross >> 32) + (other >> 32) + (middle >> 32);
+        low = (middle << 32) | (low & 0xffffffffULL);
+        low += carry;
+        high += low < carry;
+        count->limbs[i] = low;
+        carry = high;
+    }
+    if (carry && count->size < COUNT_LIMBS) {
+        count->limbs[count->size++] = carry;
+    }
+}
+
+/**
+ * count mod p for a prime p above 2^62.
+ */
+static ullong count_mod(const Count* count, ullong p) {
+    // 2^64 mod p, 2^63 is less than 2p.
+    ullong base = (1ULL << 63) - p;
+    base += base;
+    base -= base >= p ? p : 0;
+    ullong result = 0;
+    for (int i = count->size - 1; i >= 0; --i) {
+        result = mul_mod(result, base, p) + count->limbs[i] % p;
+        result -= result >= p ? p : 0;
+    }
+    return result;
+}
+
+static void* modular_work(void* arg) {
+    Modular* modular = arg;
+    modular->valid = frontier_sweep(&modular->duct, modular->lanes, modular->primes, NULL, NULL, modular->residues);
+    return NULL;
+}
+
+/**
+ * Counts the ducts with the frontier engine modulo primes on threads and
+ * rebuilds the count from the residues.  If the check prime does not agree
+ * with the count, duct->failure tells so.
+ */
+static Count frontier_count_modular(Duct* duct, int threads) {
+    Count result;
+    count_set(&result, 0);
+
+    // one prime is over 2^62 and at least one is needed, one more checks the count.
+    int used = (duct_count_bits(duct) + 61) / 62;
+    used = used < 1 ? 1 : used > COUNT_PRIMES - 1 ? COUNT_PRIMES - 1 : used;
+    int size = used + 1;
+    if (threads > size) {
+        threads = size;
+    }
+
+    Modular* workers = malloc(sizeof(Modular) * threads);
+    if (NULL == workers) {
+        duct_fail(duct, AC_NO_MEMORY, "Unable to allocate memory");
+        return result;
+    }
+    for (int i = 0; i < threads; ++i) {
+        int first = size * i / threads;
+        workers[i].duct = *duct;
+        workers[i].primes = count_primes + first;
+        workers[i].lanes = size * (i + 1) / threads - first;
+        // the first share runs on the calling thread, as does one whose thread can not start.
+        workers[i].started = i && 0 == pthread_create(&workers[i].thread, NULL, modular_work, &workers[i]);
+    }
+    ullong residues[COUNT_PRIMES];
+    bool valid = VALID;
+    for (int i = 0; i < threads; ++i) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        } else {
+            modular_work(&workers[i]);
+        }
+        memcpy(residues + (workers[i].primes - count_primes), workers[i].residues, sizeof(ullong) * workers[i].lanes);
+        valid = valid && workers[i].valid;
+        // the threads only read the tables of the duct, it may be flagged while they run.
+        duct->expired |= workers[i].duct.expired;
+        if (NULL != workers[i].duct.failure) {
+            duct_fail(duct, workers[i].duct.status, workers[i].duct.failure);
+        }
+    }
+    free(workers);
+    if (!valid || duct->expired || NULL != duct->failure) {
+        return result;
+    }
+
+    // Garner: the count is v[0] + v[1] p[0] + v[2] p[0] p[1] + ...
+    const ullong* primes = count_primes;
+    ullong v[COUNT_PRIMES] = { 0 };
+    for (int i = 0; i < used; ++i) {
+        ullong p = primes[i];
+        ullong sum = 0;
+        ullong product = 1;
+        for (int j = 0; j < i; ++j) {
+            sum = (sum + mul_mod(v[j] % p, product, p)) % p;
+            product = mul_mod(product, primes[j] % p, p);
+        }
+        ullong difference = residues[i] >= sum ? residues[i] - sum : residues[i] + (p - sum);
+        v[i] = mul_mod(difference, inverse_mod(product, p), p);
+    }
+    result.size = 1;
+    result.limbs[0] = v[used - 1];
+    for (int i = used - 2; i >= 0; --i) {
+        count_mul_add(&result, primes[i], v[i]);
+    }
+
+    if (count_mod(&result, primes[used]) != residues[used]) {
+        count_set(&result, 0);
+        duct_fail(duct, AC_CHECK_FAILED, "The residues of the modular count do not agree.");
+        return result;
+    }
+    fprintf(stderr, "modular: %d primes on %d threads, checked modulo one more\n", used, threads);
+    return result;
+}
+
+/**
+ * What-if session related functions.
+ *
+ * A plan is read once and then changed one room at a time, every change
+ * answered with the new count.  The frontier sweep keeps the states at the
+ * start of each row as Layers, so a recount resumes from the last row before
+ * the first changed cell.  The plan is also swept turned by 180 degrees,
+ * that is the rows the other way round, and a recount takes whichever of
+ * the two sweeps has fewer rows left.  Trying a room and changing it back
+ * finds the layers of the other sweep untouched.
+ *
+ * A change is "x y value": 0 or 1 takes the room or gives it up, 2 or 3
+ * moves the intake or the AC there.
+ */
+typedef struct SessionStruct {
+    Plan   plan;        // the plan with the changes so far.
+    Layers layers[2];   // of the plan as is and turned by 180 degrees.
+    ullong rows;        // rows the counts would have swept from scratch.
+} Session;
+
+/**
+ * A duct of the plan as it is, turned by 180 degrees if turn is set.
+ */
+static Duct* session_duct(Session* session, int turn) {
+    Plan plan = session->plan;
+    int area = plan.width * plan.height;
+    plan.values = malloc(sizeof(int) * area);
+    if (NULL == plan.values) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < area; ++i) {
+        plan.values[i] = session->plan.values[turn ? area - 1 - i : i];
+    }
+    Duct* duct = duct_init_plan(&plan);
+    if (NULL == duct || AC_NO_MEMORY == duct->status) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    return duct;
+}
+
+/**
+ * Counts the plan as it is, with the sweep that has fewer rows left.
+ */
+static Count session_count(Session* session) {
+    Duct* ducts[2];
+    int left[2] = { 0, 0 };
+    int rows[2] = { 0, 0 };
+    for (int turn = 0; turn < 2; ++turn) {
+        ducts[turn] = session_duct(session, turn);
+        Frontier frontier;
+        if (frontier_init(&frontier, ducts[turn])) {
+            ullong* prefix = malloc(sizeof(ullong) * (frontier.height + 1));
+            if (NULL == prefix) {
+                printf("Unable to allocate memory\n");
+                exit(1);
+            }
+            rows[turn] = frontier.last / frontier.width + 1;
+            left[turn] = rows[turn] - layers_resume(&session->layers[turn], &frontier, prefix);
+            free(prefix);
+            frontier_destroy(&frontier);
+        }
+    }
+
+    int turn = left[1] < left[0];
+    Layers* layers = &session->layers[turn];
+    uchar limbs = duct_count_limbs(ducts[turn]);
+    if (limbs > layers->limbs) {
+        // the kept states are too narrow for the count now.
+        ullong swept = layers->swept;
+        layers_destroy(layers);
+        layers_init(layers, limbs);
+        layers->swept = swept;
+    }
+
+    Count result;
+    count_set(&result, 0);
+    if (frontier_sweep(ducts[turn], layers->limbs, NULL, NULL, layers, result.limbs)) {
+        result.size = layers->limbs;
+    }
+    if (NULL != ducts[turn]->failure) {
+        printf("%s\n", ducts[turn]->failure);
+        exit(1);
+    }
+    session->rows += rows[turn];
+    duct_destroy(ducts[0]);
+    duct_destroy(ducts[1]);
+    return result;
+}
+
+/**
+ * Changes room x, y to value, returns why it can not be changed or NULL.
+ */
+static const char* session_change(Session* session, int x, int y, int value) {
+    Plan* plan = &session->plan;
+    if (x < 0 || y < 0 || x >= plan->width || y >= plan->height) {
+        return "The room is outside the plan.";
+    }
+    if (value < 0 || value > 3) {
+        return "Invalid input.";
+    }
+    if (value >= 2) {
+        // there is one intake and one AC, the room they leave is ours.
+        for (int i = 0; i < plan->width * plan->height; ++i) {
+            if (plan->values[i] == value) {
+                plan->values[i] = 0;
+            }
+        }
+    }
+    plan->values[y * plan->width + x] = value;
+    return NULL;
+}
+
+/**
+ * Reads a plan and then changes to it until the end of the input, printing
+ * the count of the plan and after every change the new count or
+ * "error: <why>".
+ */
+COMMAND void duct_session(Input* input) {
+    long int start = clock_ms();
+    Session session;
+    if (!plan_read(input, &session.plan)) {
+        printf("%s\n", session.plan.error);
+        exit(1);
+    }
+    Duct* duct = session_duct(&session, 0);
+    if (NULL != duct->error) {
+        printf("%s\n", duct->error);
+        exit(1);
+    }
+    duct_destroy(duct);
+    if (session.plan.width > FRONTIER_MAX_WIDTH && session.plan.height > FRONTIER_MAX_WIDTH) {
+        printf("The grid is too wide for the frontier engine.\n");
+        exit(1);
+    }
+    layers_init(&session.layers[0], 1);
+    layers_init(&session.layers[1], 1);
+    session.rows = 0;
+
+    Count count = session_count(&session);
+    count_print(&count);
+    fflush(stdout);
+
+    int changes = 0;
+    while (input_more(input)) {
+        int change[3];
+        int read = 1;
+        for (int i = 0; i < 3 && read != EOF; ++i) {
+            int got = input_int(input, &change[i]);
+            read = got == 1 ? read : got;
+        }
+        if (read == EOF) {
+            break;
+        }
+        const char* error = read ? session_change(&session, change[0], change[1], change[2]) : "Invalid input.";
+        if (NULL != error) {
+            printf("error: %s\n", error);
+        } else {
+            count = session_count(&session);
+            count_print(&count);
+        }
+        changes++;
+        fflush(stdout);
+    }
+
+    fprintf(stderr, "session: %d changes, %llu of %llu rows swept, %ld ms\n", changes,
+            session.layers[0].swept + session.layers[1].swept, session.rows, clock_ms() - start);
+    layers_destroy(&session.layers[0]);
+    layers_destroy(&session.layers[1]);
+    free(session.plan.values);
+}
+
+/**
+ * All pairs related functions.
+ *
+ * Counts the ducts of every intake and AC placement in one frontier sweep.
+ * A candidate room may be an end of the duct, taking one edge instead of
+ * two, so a state also remembers which rooms its PLUG_END segments started
+ * from: PAIRS_ID_BITS per end above the plugs, the end of the leftmost
+ * PLUG_END first.  Plugs never pass each other, so that order only changes
+ * when a segment is terminated and its far end becomes the PLUG_END.
+ * Ducts are undirected, a pair has one count whichever end is the intake.
+ */
+#define PAIRS_ID_BITS 10
+#define PAIRS_ID_MASK ((1ULL << PAIRS_ID_BITS) - 1)
+#define PAIRS_MAX_WIDTH 21      // the plugs and two ends fit in a key.
+
+/**
+ * How many PLUG_END plugs there are before plug i.
+ */
+static uchar pairs_rank(ullong plugs, uchar i) {
+    ullong ends = plugs & (plugs >> 1) & 0x5555555555555555ULL;
+    return __builtin_popcountll(ends & ((1ULL << (i << 1)) - 1));
+}
+
+static ullong pairs_insert(ullong ends, uchar rank, ullong id) {
+    return rank ? (ends & PAIRS_ID_MASK) | (id << PAIRS_ID_BITS) : (ends << PAIRS_ID_BITS) | id;
+}
+
+static ullong pairs_remove(ullong ends, uchar rank) {
+    return rank ? ends & PAIRS_ID_MASK : ends >> PAIRS_ID_BITS;
+}
+
+/**
+ * Checks the checkerboard colours of a new end at cell i, ended ends are
+ * already placed.  A duct alternates colours, so with as many rooms of each
+ * colour its ends differ and with one more of a colour both have that one;
+ * balance is the count of colour 0 minus that of colour 1.
+ */
+static bool pairs_can_end(ullong ends, uchar ended, int i, ushort width, int balance) {
+    uchar colour = (i % width + i / width) & 1;
+    if (ended == 2) {
+        return INVALID;
+    } else if (balance) {
+        return balance == (colour ? -1 : 1);
+    } else if (ended == 1) {
+        int first = ends & PAIRS_ID_MASK;
+        return colour != ((first % width + first / width) & 1);
+    }
+    return VALID;
+}
+
+/**
+ * Prints the count of every pair of a plan of rooms, one line of intake
+ * column and row, AC column and row and count per pair.  The intake may be
+ * any room marked 2 and the AC any room marked 3; without marks any room
+ * may be either and every pair is printed once.
+ */
+COMMAND bool pairs_count(const Plan* plan) {
+    int area = plan->width * plan->height;
+    bool transpose = plan->width > plan->height;
+    ushort width = transpose ? plan->height : plan->width;
+    ushort height = transpose ? plan->width : plan->height;
+    bool marked[4] = { 0 };
+
+    for (int i = 0; i < area; ++i) {
+        if (plan->values[i] < 0 || plan->values[i] > 3) {
+            printf("Invalid input.\n");
+            return INVALID;
+        }
+        marked[plan->values[i]] = 1;
+    }
+    if (width > PAIRS_MAX_WIDTH) {
+        printf("The grid is too wide for the all pairs sweep.\n");
+        return INVALID;
+    }
+
+    // the sweep runs over the narrow side, cells 2 are the candidate ends.
+    Frontier frontier;
+    frontier.width = width;
+    frontier.height = height;
+    frontier.cells = malloc(sizeof(uchar) * area);
+    frontier.edges = calloc(area, sizeof(uchar));
+    frontier.last = -1;
+    ushort* candidates = malloc(sizeof(ushort) * area);  // per candidate sweep cell, its row of the results.
+    if (NULL == frontier.cells || NULL == frontier.edges || NULL == candidates) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+
+    int size = 0;
+    ullong bits = 0;
+    int balance = 0;
+    for (int i = 0; i < area; ++i) {
+        int x = i % width;
+        int y = i / width;
+        int position = transpose ? x * plan->width + y : i;
+        int value = plan->values[position];
+        int right = transpose ? position + plan->width : position + 1;
+        int down = transpose ? position + 1 : position + plan->width;
+
+        frontier.cells[i] = value == 1 ? 1 : 0;
+        if (value == 1) {
+            continue;
+        }
+        frontier.last = i;
+        balance += (x + y) & 1 ? -1 : 1;
+        if ((value == 2 || !marked[2]) || (value == 3 || !marked[3])) {
+            frontier.cells[i] = 2;
+            candidates[i] = size++;
+        }
+        if (x + 1 < width && plan->values[right] != 1) {
+            frontier.edges[i] |= FRONTIER_RIGHT;
+        }
+        if (y + 1 < height && plan->values[down] != 1) {
+            frontier.edges[i] |= FRONTIER_DOWN;
+        }
+        int links = (x > 0 && plan->values[transpose ? position - plan->width : position - 1] != 1) +
+            (y > 0 && plan->values[transpose ? position - 1 : position - plan->width] != 1) +
+            !!(frontier.edges[i] & FRONTIER_RIGHT) + !!(frontier.edges[i] & FRONTIER_DOWN);
+        bits += log2_choices[links];
+    }
+
+    uchar limbs = count_limbs((bits + 1023) >> 10);
+    ullong* results = calloc((size_t) size * size * limbs, sizeof(ullong));
+    if (NULL == results) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+
+    uchar shift = (width + 1) << 1;
+    ullong plug_mask = (1ULL << shift) - 1;
+    ullong one[COUNT_LIMBS] = { 1 };
+    uchar* cells = frontier.cells;
+    StateMap maps[2];
+    if (!state_map_init(&maps[0], 1 << 10, limbs) || !state_map_init(&maps[1], 1 << 10, limbs)) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    StateMap* curr = &maps[0];
+    StateMap* next = &maps[1];
+    state_map_add(curr, 0, one);
+
+    for (int i = 0; i <= frontier.last; ++i) {
+        uchar x = i % width;
+        uchar cell = cells[i];
+        bool can_down  = frontier.edges[i] & FRONTIER_DOWN;
+        bool can_right = frontier.edges[i] & FRONTIER_RIGHT;
+        bool last = i == frontier.last;
+
+        state_map_clear(next);
+        for (size_t slot = 0; slot < curr->capacity; ++slot) {
+
+            ullong key = curr->keys[slot];
+            if (key == STATE_EMPTY) {
+                continue;
+            }
+            const ullong* count = curr->counts + slot * limbs;
+            ullong plugs = key & plug_mask;
+            ullong ends = key >> shift;
+            ullong high = key & ~plug_mask;
+            if (x == 0) {
+                plugs = (plugs << 2) & plug_mask;
+            }
+            uchar left = plug_get(plugs, x);
+            uchar up = plug_get(plugs, x + 1);
+            ullong rest = plug_set(plug_set(plugs, x, PLUG_NONE), x + 1, PLUG_NONE);
+            uchar ended = pairs_rank(plugs, width + 1);
+            ullong* result = NULL;
+
+            if (cell == 1) {
+                if (!left && !up) {
+                    state_map_add(next, plugs | high, count);
+                }
+            } else if (!left && !up) {
+                if (can_down && can_right) {
+                    state_map_add(next, plug_set(plug_set(rest, x, PLUG_OPEN), x + 1, PLUG_CLOSE) | high, count);
+                }
+                // or the duct starts here.
+                bool can_end = cell == 2 && pairs_can_end(ends, ended, i, width, balance);
+                for (uchar at = x; can_end && at <= x + 1; ++at) {
+                    if (at == x ? can_down : can_right) {
+                        ullong key_plugs = plug_set(rest, at, PLUG_END);
+                        state_map_add(next, key_plugs | pairs_insert(ends, pairs_rank(key_plugs, at), i) << shift, count);
+                    }
+                }
+            } else if (!left || !up) {
+                uchar plug = left | up;
+                uchar at = left ? x : x + 1;
+                if (can_down) {
+                    state_map_add(next, plug_set(rest, x, plug) | high, count);
+                }
+                if (can_right) {
+                    state_map_add(next, plug_set(rest, x + 1, plug) | high, count);
+                }
+                // or the duct ends here.
+                if (cell == 2 && plug == PLUG_END) {
+                    if (last && rest == 0) {
+                        result = results + ((size_t) candidates[ends] * size + candidates[i]) * limbs;
+                    }
+                } else if (cell == 2 && pairs_can_end(ends, ended, i, width, balance)) {
+                    uchar far = plug == PLUG_OPEN ? plug_close_of(plugs, at) : plug_open_of(plugs, at);
+                    ullong key_plugs = plug_set(rest, far, PLUG_END);
+                    state_map_add(next, key_plugs | pairs_insert(ends, pairs_rank(key_plugs, far), i) << shift, count);
+                }
+            } else if (left == PLUG_END && up == PLUG_END) {
+                if (last && rest == 0) {
+                    ushort a = candidates[ends & PAIRS_ID_MASK];
+                    ushort b = candidates[ends >> PAIRS_ID_BITS];
+                    result = results + ((size_t) (a < b ? a : b) * size + (a < b ? b : a)) * limbs;
+                }
+            } else if (left == PLUG_END || up == PLUG_END) {
+                // the far end of the bracket takes over the end of the PLUG_END.
+                uchar from = (left == PLUG_END) ? x : x + 1;
+                uchar at = (left == PLUG_END) ? x + 1 : x;
+                uchar plug = (left == PLUG_END) ? up : left;
+                uchar rank = pairs_rank(plugs, from);
+                uchar far = plug == PLUG_OPEN ? plug_close_of(plugs, at) : plug_open_of(plugs, at);
+                ullong id = (ends >> (rank * PAIRS_ID_BITS)) & PAIRS_ID_MASK;
+                ullong key_plugs = plug_set(rest, far, PLUG_END);
+                ends = pairs_insert(pairs_remove(ends, rank), pairs_rank(key_plugs, far), id);
+                state_map_add(next, key_plugs | ends << shift, count);
+            } else if (left == PLUG_OPEN && up == PLUG_OPEN) {
+                state_map_add(next, plug_set(rest, plug_close_of(plugs, x + 1), PLUG_OPEN) | high, count);
+            } else if (left == PLUG_CLOSE && up == PLUG_CLOSE) {
+                state_map_add(next, plug_set(rest, plug_open_of(plugs, x), PLUG_CLOSE) | high, count);
+            } else if (left == PLUG_CLOSE && up == PLUG_OPEN) {
+                state_map_add(next, rest | high, count);
+            }
+            if (NULL != result) {
+                count_add(result, count, limbs);
+            }
+        }
+        if (next->starved) {
+            printf("Unable to allocate memory\n");
+            exit(1);
+        }
+
+        StateMap* swap = curr;
+        curr = next;
+        next = swap;
+    }
+
+    // a duct is counted under its ends in sweep order.
+    Count pair;
+    pair.size = limbs;
+    for (int s = 0; s < area; ++s) {
+        int i = transpose ? (s % plan->width) * width + s / plan->width : s;
+        if (cells[i] != 2 || (marked[2] && plan->values[s] != 2)) {
+            continue;
+        }
+        for (int t = marked[2] || marked[3] ? 0 : s + 1; t < area; ++t) {
+            int j = transpose ? (t % plan->width) * width + t / plan->width : t;
+            if (t == s || cells[j] != 2 || (marked[3] && plan->values[t] != 3)) {
+                continue;
+            }
+            int a = candidates[i < j ? i : j];
+            int b = candidates[i < j ? j : i];
+            memcpy(pair.limbs, results + ((size_t) a * size + b) * limbs, sizeof(ullong) * limbs);
+            printf("%d %d %d %d ", s % plan->width, s / plan->width, t % plan->width, t / plan->width);
+            count_print(&pair);
+        }
+    }
+
+    state_map_destroy(&maps[0]);
+    state_map_destroy(&maps[1]);
+    frontier_destroy(&frontier);
+    free(candidates);
+    free(results);
+    return VALID;
+}
+
+typedef enum EngineEnum {
+    ENGINE_DFS = AC_ENGINE_DFS,
+    ENGINE_FRONTIER = AC_ENGINE_FRONTIER,
+    ENGINE_BIDIRECTIONAL = AC_ENGINE_BIDIRECTIONAL,
+    ENGINE_MODULAR = AC_ENGINE_MODULAR,
+    ENGINE_EXTERNAL = AC_ENGINE_EXTERNAL
+} Engine;
+
+/**
+ * Wall-clock milliseconds, CPU time would add up over the worker threads.
+ */
+static long int clock_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long int) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// How to count a plan, as given on the command line.
+typedef struct OptionsStruct {
+    Engine engine;
+    int    threads;
+    int    depth;
+    size_t memo_bytes;
+    const char* spill_dir;
+} Options;
+
+/**
+ * Counts the ducts of a plan read by duct_init with the chosen engine.  If
+ * the count fails, its own check or for want of memory or spill files,
+ * duct->failure tells why.
+ */
+static Count duct_count(Duct* duct, const Options* options) {
+    Count result;
+    count_set(&result, 0);
+
+    // the search engines count in an ullong.  Plain search adds ducts one at a
+    // time and would never finish past 64 bits, but the memo and bidirectional
+    // engines add up stored counts and wrap silently; duct_count_bits is too
+    // loose a bound to refuse them by.
+    if (options->engine == ENGINE_FRONTIER) {
+        result = frontier_count(duct);
+    } else if (options->engine == ENGINE_MODULAR) {
+        result = frontier_count_modular(duct, options->threads);
+    } else if (options->engine == ENGINE_EXTERNAL) {
+        // the memo budget caps the state maps instead.
+        size_t bytes = options->memo_bytes ? options->memo_bytes : EXTERNAL_BYTES;
+        result = frontier_count_external(duct, bytes, options->spill_dir);
+    } else if (options->engine == ENGINE_BIDIRECTIONAL) {
+        // the memo budget caps the halves instead.
+        size_t bytes = options->memo_bytes ? options->memo_bytes : BIDIRECTIONAL_BYTES;
+        count_set(&result, duct_search_bidirectional(duct, bytes));
+    } else if (options->threads > 1) {
+        count_set(&result, duct_search_parallel(duct, options->threads, options->depth, options->memo_bytes));
+    } else if (options->memo_bytes) {
+        Memo memo;
+        if (!memo_init(&memo, options->memo_bytes)) {
+            printf("Unable to allocate memory\n");
+            exit(1);
+        }
+        duct->memo = &memo;
+        count_set(&result, duct_search_root(duct));
+        duct->memo = NULL;
+        memo_report(&memo);
+        memo_destroy(&memo);
+    } else {
+        count_set(&result, duct_search_root(duct));
+    }
+    return result;
+}
+
+/**
+ * Counts like duct_count, but returns AC_BAD_ENGINE with error set if the
+ * engine can not count the plan, gives up with AC_TIMEOUT after timeout_ms
+ * if that is more than 0, and returns the status of duct->failure if the
+ * count failed.
+ */
+static AcStatus duct_count_within(Duct* duct, const Options* options, long int timeout_ms, Count* result, const char** error) {
+    Engine engine = options->engine;
+    count_set(result, 0);
+    *error = NULL;
+    if ((engine == ENGINE_FRONTIER || engine == ENGINE_MODULAR || engine == ENGINE_EXTERNAL) &&
+        duct->width > FRONTIER_MAX_WIDTH && duct->height > FRONTIER_MAX_WIDTH) {
+        *error = "The grid is too wide for the frontier engine.";
+        return AC_BAD_ENGINE;
+    }
+    if (engine != ENGINE_DFS && engine != ENGINE_FRONTIER && engine != ENGINE_BIDIRECTIONAL &&
+        engine != ENGINE_MODULAR && engine != ENGINE_EXTERNAL) {
+        *error = "Unknown engine.";
+        return AC_BAD_ENGINE;
+    }
+
+    duct->deadline = timeout_ms > 0 ? clock_ms() + timeout_ms : 0;
+    duct->expired = 0;
+    duct->failure = NULL;
+    duct->status = AC_OK;
+    *result = duct_count(duct, options);
+    duct->deadline = 0;
+    if (duct->expired) {
+        count_set(result, 0);
+        *error = "The count took longer than its timeout.";
+        return AC_TIMEOUT;
+    }
+    if (NULL != duct->failure) {
+        count_set(result, 0);
+        *error = duct->failure;
+        return duct->status;
+    }
+    return AC_OK;
+}
+
+/**
+ * Library related functions, see ac.h.
+ *
+ * A context is a duct read from memory with duct_init_plan, counted with
+ * one thread and no memo.
+ */
+struct AcContextStruct {
+    Duct*       duct;
+    const char* error;  // why the last call failed, NULL if it did not.
+};
+
+AcStatus ac_create(AcContext** context, int width, int height, const int* rooms) {
+    *context = malloc(sizeof(AcContext));
+    if (NULL == *context) {
+        return AC_NO_MEMORY;
+    }
+    (*context)->duct = NULL;
+    (*context)->error = plan_check_size(width, height);
+    if (NULL != (*context)->error) {
+        return AC_BAD_PLAN;
+    }
+
+    Plan plan;
+    plan.width = width;
+    plan.height = height;
+    plan.error = NULL;
+    plan.no_memory = 0;
+    plan.values = malloc(sizeof(int) * width * height);
+    if (NULL == plan.values) {
+        (*context)->error = "Unable to allocate memory";
+        return AC_NO_MEMORY;
+    }
+    memcpy(plan.values, rooms, sizeof(int) * width * height);
+    (*context)->duct = duct_init_plan(&plan);
+    if (NULL == (*context)->duct) {
+        (*context)->error = "Unable to allocate memory";
+        return AC_NO_MEMORY;
+    }
+    (*context)->error = (*context)->duct->error;
+    if (NULL == (*context)->error) {
+        return AC_OK;
+    }
+    return AC_NO_MEMORY == (*context)->duct->status ? AC_NO_MEMORY : AC_BAD_PLAN;
+}
+
+AcStatus ac_count(AcContext* context, AcEngine engine, long int timeout_ms, char* count, size_t size) {
+    if (NULL == context->duct || NULL != context->duct->error) {
+        context->error = NULL != context->duct ? context->duct->error : context->error;
+        return NULL != context->duct && AC_NO_MEMORY == context->duct->status ? AC_NO_MEMORY : AC_BAD_PLAN;
+    }
+    Options options = { (Engine) engine, 1, 0, 0, NULL };
+    Count result;
+    AcStatus status = duct_count_within(context->duct, &options, timeout_ms, &result, &context->error);
+    if (AC_OK == status && !count_format(&result, count, size)) {
+        context->error = "The count does not fit in the buffer.";
+        status = AC_SHORT_BUFFER;
+    }
+    return status;
+}
+
+const char* ac_error(const AcContext* context) {
+    return NULL == context ? "Unable to allocate memory" : NULL != context->error ? context->error : "";
+}
+
+void ac_destroy(AcContext* context) {
+    if (NULL != context) {
+        duct_destroy(context->duct);
+        free(context);
+    }
+}
+
+/**
+ * Batch mode.
+ *
+ * Plans are read one after another from stdin and answered in order, one
+ * count or "error: <why>" per line.  A plan that is a rotated or mirrored
+ * copy of one answered before is looked up in a cache keyed by its
+ * canonical form.  With threads, up to BATCH_CHUNK plans per thread are
+ * read at a time and each plan is counted by one thread.
+ */
+#define BATCH_CHUNK  64
+
+// Counts of the plans answered so far, keyed by their canonical form.
+typedef struct PlanCacheStruct {
+    ushort** keys;      // NULL marks an empty slot.
+    ullong*  hashes;
+    Count*   counts;
+    size_t   size;
+    size_t   capacity;  // always a power of 2.
+} PlanCache;
+
+// A plan of the chunk being answered.
+typedef struct BatchPlanStruct {
+    Duct*   duct;
+    ushort  key[MAX_AREA + 2]; // canonical form, valid when the plan was read.
+    int     length;
+    ullong  hash;
+    long    same;       // index of an earlier plan of the chunk with the same key, or -1.
+    bool    known;      // true once count holds the answer.
+    const char* error;  // why the plan is answered with an error, NULL if it is not.
+    Count   count;
+} BatchPlan;
+
+typedef struct BatchStruct {
+    BatchPlan*      plans;
+    size_t          size;
+    size_t          next;       // the next plan to hand out to a thread.
+    pthread_mutex_t lock;
+    const Options*  options;
+} Batch;
+
+static void plan_cache_init(PlanCache* cache, size_t capacity) {
+    cache->keys = calloc(capacity, sizeof(ushort*));
+    cache->hashes = malloc(sizeof(ullong) * capacity);
+    cache->counts = malloc(sizeof(Count) * capacity);
+    if (NULL == cache->keys || NULL == cache->hashes || NULL == cache->counts) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    cache->size = 0;
+    cache->capacity = capacity;
+}
+
+static void plan_cache_destroy(PlanCache* cache) {
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        free(cache->keys[i]);
+    }
+    free(cache->keys);
+    free(cache->hashes);
+    free(cache->counts);
+    cache->keys = NULL;
+}
+
+static ullong plan_hash(const ushort* key, int length) {
+    ullong hash = length;
+    for (int i = 0; i < length; ++i) {
+        hash = memo_mix(hash ^ key[i]);
+    }
+    return hash;
+}
+
+/**
+ * Finds the slot of a key, empty slots have no key.  Keys start with the
+ * width and height, so equal keys have equal lengths.
+ */
+static size_t plan_cache_slot(PlanCache* cache, const ushort* key, int length, ullong hash) {
+    size_t mask = cache->capacity - 1;
+    size_t slot = hash & mask;
+    while (NULL != cache->keys[slot] &&
+           (cache->hashes[slot] != hash || memcmp(cache->keys[slot], key, sizeof(ushort) * length))) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static bool plan_cache_find(PlanCache* cache, const BatchPlan* plan, Count* count) {
+    size_t slot = plan_cache_slot(cache, plan->key, plan->length, plan->hash);
+    if (NULL == cache->keys[slot]) {
+        return INVALID;
+    }
+    *count = cache->counts[slot];
+    return VALID;
+}
+
+static void plan_cache_store(PlanCache* cache, const BatchPlan* plan) {
+    if ((cache->size + 1) << 1 > cache->capacity) {
+        PlanCache bigger;
+        plan_cache_init(&bigger, cache->capacity << 1);
+        for (size_t i = 0; i < cache->capacity; ++i) {
+            if (NULL != cache->keys[i]) {
+                size_t slot = cache->hashes[i] & (bigger.capacity - 1);
+                while (NULL != bigger.keys[slot]) {
+                    slot = (slot + 1) & (bigger.capacity - 1);
+                }
+                bigger.keys[slot] = cache->keys[i];
+                bigger.hashes[slot] = cache->hashes[i];
+                bigger.counts[slot] = cache->counts[i];
+                cache->keys[i] = NULL;
+            }
+        }
+        bigger.size = cache->size;
+        plan_cache_destroy(cache);
+        *cache = bigger;
+    }
+
+    size_t slot = plan_cache_slot(cache, plan->key, plan->length, plan->hash);
+    if (NULL != cache->keys[slot]) {
+        return;
+    }
+    cache->keys[slot] = malloc(sizeof(ushort) * plan->length);
+    if (NULL == cache->keys[slot]) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    memcpy(cache->keys[slot], plan->key, sizeof(ushort) * plan->length);
+    cache->hashes[slot] = plan->hash;
+    cache->counts[slot] = plan->count;
+    cache->size++;
+}
+
+/**
+ * Counts the plans of the batch that are not known yet, one plan at a time.
+ */
+static void* batch_work(void* arg) {
+    Batch* batch = arg;
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        size_t i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->size) {
+            return NULL;
+        }
+        BatchPlan* plan = batch->plans + i;
+        if (NULL == plan->error && !plan->known && plan->same < 0) {
+            plan->count = duct_count(plan->duct, batch->options);
+            // answered as an error, and never cached.
+            plan->error = plan->duct->failure;
+        }
+    }
+}
+
+/**
+ * Answers every plan of input.
+ */
+COMMAND void duct_batch(Input* input, const Options* options) {
+    int threads = options->threads;
+    size_t chunk = threads > 1 ? (size_t) threads * BATCH_CHUNK : 1;
+    size_t plans = 0;
+    size_t cached = 0;
+    long int start = clock_ms();
+
+    Options single = *options;
+    single.threads = 1;
+
+    Batch batch;
+    batch.plans = malloc(sizeof(BatchPlan) * chunk);
+    batch.options = &single;
+    pthread_t* workers = malloc(sizeof(pthread_t) * threads);
+    if (NULL == batch.plans || NULL == workers) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    PlanCache cache;
+    plan_cache_init(&cache, 1 << 10);
+
+    bool more = input_more(input);
+    while (more) {
+        // read a chunk, answering what the cache or an earlier plan of the chunk knows.
+        batch.size = 0;
+        while (batch.size < chunk && (more = input_more(input))) {
+            BatchPlan* plan = batch.plans + batch.size++;
+            plan->duct = duct_init(input);
+            if (NULL == plan->duct) {
+                printf("Unable to allocate memory\n");
+                exit(1);
+            }
+            plan->known = 0;
+            plan->same = -1;
+            plan->error = plan->duct->error;
+            if (NULL != plan->error) {
+                continue;
+            }
+            plan->length = duct_canonical(plan->duct, plan->key);
+            plan->hash = plan_hash(plan->key, plan->length);
+            if (plan_cache_find(&cache, plan, &plan->count)) {
+                plan->known = 1;
+                continue;
+            }
+            for (size_t i = 0; i + 1 < batch.size; ++i) {
+                BatchPlan* other = batch.plans + i;
+                if (NULL == other->error && other->hash == plan->hash && other->length == plan->length &&
+                    !memcmp(other->key, plan->key, sizeof(ushort) * plan->length)) {
+                    plan->same = other->same < 0 ? (long) i : other->same;
+                    break;
+                }
+            }
+        }
+
+        batch.next = 0;
+        if (threads > 1) {
+            for (int i = 0; i < threads; ++i) {
+                if (0 != pthread_create(&workers[i], NULL, batch_work, &batch)) {
+                    printf("Unable to start a worker thread\n");
+                    exit(1);
+                }
+            }
+            for (int i = 0; i < threads; ++i) {
+                pthread_join(workers[i], NULL);
+            }
+        } else {
+            batch_work(&batch);
+        }
+
+        for (size_t i = 0; i < batch.size; ++i) {
+            BatchPlan* plan = batch.plans + i;
+            if (plan->same >= 0 && NULL != batch.plans[plan->same].error) {
+                printf("error: %s\n", batch.plans[plan->same].error);
+            } else if (NULL != plan->error) {
+                printf("error: %s\n", plan->error);
+            } else {
+                if (plan->same >= 0) {
+                    plan->count = batch.plans[plan->same].count;
+                }
+                cached += plan->known || plan->same >= 0;
+                plan_cache_store(&cache, plan);
+                count_print(&plan->count);
+            }
+        }
+        // the answers of the chunk may read any of its plans, so free them once all are printed.
+        for (size_t i = 0; i < batch.size; ++i) {
+            duct_destroy(batch.plans[i].duct);
+        }
+        plans += batch.size;
+        fflush(stdout);
+    }
+
+    fprintf(stderr, "batch: %zu plans, %zu from the cache, %ld ms\n", plans, cached, clock_ms() - start);
+    plan_cache_destroy(&cache);
+    pthread_mutex_destroy(&batch.lock);
+    free(workers);
+    free(batch.plans);
+}
+
+/**
+ * Daemon mode.
+ *
+ * ac -D socket serves counts over a Unix domain socket, so a service does
+ * not start a process per plan.  A client writes plans in either input
+ * format and reads back one line per plan, the count or "error: <why>" as
+ * in batch mode, for as long as it keeps the connection.  A fixed pool of
+ * -t threads takes turns accepting connections and counts the plans of
+ * each on one thread with the -e engine, through duct_count_within: a count
+ * running past -o milliseconds is dropped and answered with an error.  The
+ * threads share one PlanCache keyed by the canonical form, emptied when it
+ * holds DAEMON_CACHE plans.  ac -C socket is a client that sends stdin and
+ * prints the answers.
+ */
+#define DAEMON_BACKLOG 64
+#define DAEMON_CACHE   (1 << 16)
+#define DAEMON_IDLE_S  60       // a connection without a plan for that long is closed.
+#define DAEMON_PAUSE_MS 100     // wait before accepting again when out of descriptors or memory.
+
+typedef struct DaemonStruct {
+    int             listener;
+    Options         options;
+    long int        timeout_ms;
+    PlanCache       cache;
+    pthread_mutex_t lock;       // guards the cache.
+} Daemon;
+
+/**
+ * Writes all size bytes of data to fd, INVALID if the other end went away.
+ */
+static bool socket_write(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0) {
+            return INVALID;
+        }
+        data += written;
+        size -= written;
+    }
+    return VALID;
+}
+
+/**
+ * Answers the plans of one connection until the client closes it.
+ */
+static void daemon_serve(Daemon* daemon, Input* input, BatchPlan* plan) {
+    char line[AC_COUNT_DIGITS + 64];
+    while (input_more(input)) {
+        plan->duct = duct_init(input);
+        if (NULL == plan->duct) {
+            // the plan is still unread, so the connection can not go on with the next one.
+            strcpy(line, "error: Unable to allocate memory\n");
+            socket_write(input->fd, line, strlen(line));
+            break;
+        }
+        const char* error = plan->duct->error;
+        if (NULL == error) {
+            plan->length = duct_canonical(plan->duct, plan->key);
+            plan->hash = plan_hash(plan->key, plan->length);
+            pthread_mutex_lock(&daemon->lock);
+            plan->known = plan_cache_find(&daemon->cache, plan, &plan->count);
+            pthread_mutex_unlock(&daemon->lock);
+            if (!plan->known &&
+                AC_OK == duct_count_within(plan->duct, &daemon->options, daemon->timeout_ms, &plan->count, &error)) {
+                pthread_mutex_lock(&daemon->lock);
+                if (daemon->cache.size >= DAEMON_CACHE) {
+                    plan_cache_destroy(&daemon->cache);
+                    plan_cache_init(&daemon->cache, 1 << 10);
+                }
+                plan_cache_store(&daemon->cache, plan);
+                pthread_mutex_unlock(&daemon->lock);
+            }
+        }
+
+        if (NULL != error) {
+            snprintf(line, sizeof(line), "error: %s\n", error);
+        } else {
+            count_format(&plan->count, line, sizeof(line) - 1);
+            strcat(line, "\n");
+        }
+        duct_destroy(plan->duct);
+        if (!socket_write(input->fd, line, strlen(line))) {
+            break;
+        }
+    }
+}
+
+static void* daemon_work(void* arg) {
+    Daemon* daemon = arg;
+    Input* input = malloc(sizeof(Input));
+    BatchPlan* plan = malloc(sizeof(BatchPlan));
+    if (NULL == input || NULL == plan) {
+        fprintf(stderr, "daemon: unable to allocate memory for a worker\n");
+        free(plan);
+        free(input);
+        return NULL;
+    }
+    struct timeval idle = { DAEMON_IDLE_S, 0 };
+    struct timespec pause = { 0, DAEMON_PAUSE_MS * 1000000L };
+
+    for (;;) {
+        int fd = accept(daemon->listener, NULL, NULL);
+        if (fd < 0 && (EINTR == errno || ECONNABORTED == errno || EPROTO == errno)) {
+            continue;
+        }
+        if (fd < 0 && (EMFILE == errno || ENFILE == errno || ENOBUFS == errno || ENOMEM == errno)) {
+            // retrying at once would spin until a connection is closed.
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        if (fd < 0) {
+            fprintf(stderr, "daemon: unable to accept connections: %s\n", strerror(errno));
+            break;
+        }
+        // a read timing out ends the input, which closes the connection.
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        input_init(input);
+        input->fd = fd;
+        daemon_serve(daemon, input, plan);
+        close(fd);
+    }
+    free(plan);
+    free(input);
+    return NULL;
+}
+
+/**
+ * Serves counts on the socket at path until the process is stopped, returns
+ * INVALID if every worker had to stop accepting connections.
+ */
+COMMAND bool duct_daemon(const char* path, const Options* options, long int timeout_ms) {
+    static Daemon daemon;
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("The socket path is too long.\n");
+        exit(1);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    // a socket left behind by an earlier daemon, never any other file.
+    struct stat info;
+    if (0 == lstat(path, &info) && S_ISSOCK(info.st_mode)) {
+        unlink(path);
+    }
+    daemon.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon.listener < 0 || 0 != bind(daemon.listener, (struct sockaddr*) &address, sizeof(address)) ||
+        0 != listen(daemon.listener, DAEMON_BACKLOG)) {
+        printf("Unable to listen on %s\n", path);
+        exit(1);
+    }
+    // a client gone before its answer shows as a failed write instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    daemon.options = *options;
+    daemon.options.threads = 1;
+    daemon.timeout_ms = timeout_ms;
+    plan_cache_init(&daemon.cache, 1 << 10);
+    pthread_mutex_init(&daemon.lock, NULL);
+
+    int threads = options->threads;
+    pthread_t* workers = malloc(sizeof(pthread_t) * threads);
+    if (NULL == workers) {
+        printf("Unable to allocate memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; ++i) {
+        if (0 != pthread_create(&workers[i], NULL, daemon_work, &daemon)) {
+            printf("Unable to start a worker thread\n");
+            exit(1);
+        }
+    }
+    fprintf(stderr, "daemon: listening on %s with %d workers\n", path, threads);
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    close(daemon.listener);
+    return INVALID;
+}
+
+/**
+ * Sends stdin to the daemon at path and copies its answers to stdout.
+ */
+COMMAND bool duct_client(const char* path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("The socket path is too long.\n");
+        return INVALID;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || 0 != connect(fd, (struct sockaddr*) &address, sizeof(address))) {
+        printf("Unable to connect to %s\n", path);
+        return INVALID;
+    }
+
+    // answers are read while plans are still sent, so neither side waits on a full buffer.
+    static char buffer[INPUT_BLOCK];
+    struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            break;
+        }
+        if (fds[0].revents) {
+            ssize_t size = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (size <= 0) {
+                // no more plans, the daemon sees the end of its input.
+                shutdown(fd, SHUT_WR);
+                fds[0].fd = -1;
+            } else if (!socket_write(fd, buffer, size)) {
+                break;
+            }
+        }
+        if (fds[1].revents) {
+            ssize_t size = read(fd, buffer, sizeof(buffer));
+            if (size <= 0) {
+                break;
+            }
+            fwrite(buffer, 1, size, stdout);
+            fflush(stdout);
+        }
+    }
+    close(fd);
+    return VALID;
+}
+
+/**
+ * Sharded counting.
+ *
+ * One count is spread over processes that only share files.  The tasks of
+ * the parallel search are dealt round robin into shard files, so every
+ * shard gets prefixes from all over the tree rather than one expensive
+ * corner of it.  A worker counts the tasks of one shard and prints a part
+ * record; merging the parts of every shard gives the count.  Shard 0 also
+ * carries the ducts too short to reach a task.
+ */
+#define SHARD_MAGIC  "DUCTSHRD"
+
+// The tasks of one shard file, see shard_write.
+typedef struct ShardStruct {
+    ullong  fingerprint; // of the plan, see checkpoint_fingerprint.
+    ullong  index;
+    ullong  shards;
+    ullong  result;     // the ducts shorter than the tasks, 0 but in shard 0.
+    TaskList tasks;
+} Shard;
+
+/**
+ * Cuts the search tree of duct and writes its tasks to prefix.0 up to
+ * prefix.(shards - 1), a depth of 0 picks one with plenty of tasks.
+ */
+COMMAND bool shard_write(Duct* duct, const char* prefix, int shards, ushort depth) {
+    TaskList tasks;
+    ullong fingerprint = checkpoint_fingerprint(duct);
+    ullong result = duct_split_tasks(duct, &tasks, depth, (size_t) shards * 64);
+    bool written = VALID;
+
+    for (int i = 0; i < shards && written; ++i) {
+        char name[4096];
+        snprintf(name, sizeof(name), "%s.%d", prefix, i);
+        FILE* file = fopen(name, "wb");
+        if (NULL == file) {
+            fprintf(stderr, "shard: unable to write %s\n", name);
+            written = INVALID;
+            break;
+        }
+        ullong index = i;
+        ullong count = shards;
+        ullong base = i ? 0 : result;
+        ullong size = tasks.size > (size_t) i ? (tasks.size - i - 1) / shards + 1 : 0;
+        written =
+            fwrite(SHARD_MAGIC, 1, 8, file) == 8 &&
+            fwrite(&fingerprint, sizeof(ullong), 1, file) == 1 &&
+            fwrite(&index, sizeof(ullong), 1, file) == 1 &&
+            fwrite(&count, sizeof(ullong), 1, file) == 1 &&
+            fwrite(&base, sizeof(ullong), 1, file) == 1 &&
+            fwrite(&tasks.length, sizeof(ushort), 1, file) == 1 &&
+            fwrite(&size, sizeof(ullong), 1, file) == 1;
+        for (size_t task = i; task < tasks.size && written; task += shards) {
+            written =
+                fwrite(tasks.paths + task * tasks.length, sizeof(ushort), tasks.length, file) == tasks.length &&
+                fwrite(tasks.weights + task, sizeof(uchar), 1, file) == 1;
+        }
+        if (0 != fclose(file) || !written) {
+            fprintf(stderr, "shard: unable to write %s\n", name);
+            written = INVALID;
+        }
+    }
+    if (written) {
+        fprintf(stderr, "shard: %zu tasks of %d rooms in %d shards\n", tasks.size, tasks.length, shards);
+    }
+    task_list_destroy(&tasks);
+    return written;
+}
+
+/**
+ * Loads a shard file written for the plan of duct.
+ */
+static bool shard_read(Duct* duct, const char* name, Shard* shard) {
+    FILE* file = fopen(name, "rb");
+    if (NULL == file) {
+        return INVALID;
+    }
+    char magic[8];
+    ushort length = 0;
+    ullong size = 0;
+    bool valid =
+        fread(magic, 1, 8, file) == 8 && 0 == memcmp(magic, SHARD_MAGIC, 8) &&
+        fread(&shard->fingerprint, sizeof(ullong), 1, file) == 1 &&
+        shard->fingerprint == checkpoint_fingerprint(duct) &&
+        fread(&shard->index, sizeof(ullong), 1, file) == 1 &&
+        fread(&shard->shards, sizeof(ullong), 1, file) == 1 &&
+        shard->index < shard->shards &&
+        fread(&shard->result, sizeof(ullong), 1, file) == 1 &&
+        fread(&length, sizeof(ushort), 1, file) == 1 &&
+        length >= 1 && length <= duct->max_length &&
+        fread(&size, sizeof(ullong), 1, file) == 1;
+    if (!valid) {
+        fclose(file);
+        return INVALID;
+    }
+
+    task_list_init(&shard->tasks, length);
+    ushort path[MAX_AREA];
+    for (ullong i = 0; i < size && valid; ++i) {
+        valid =
+            fread(path, sizeof(ushort), length, file) == length &&
+            fread(&shard->tasks.weight, sizeof(uchar), 1, file) == 1;
+        // the prefix must be a path from the start through distinct rooms we own.
+        for (ushort j = 0; j < length && valid; ++j) {
+            valid = path[j] < duct->width * duct->height && duct->rooms[path[j]] != IGNORE &&
+                (j ? duct_has_edge(duct, path[j - 1], path[j]) : path[j] == duct->start);
+            for (ushort k = 0; k < j && valid; ++k) {
+                valid = path[k] != path[j];
+            }
+        }
+        if (valid) {
+            memcpy(duct->path, path, sizeof(ushort) * (length - 1));
+            task_list_add(&shard->tasks, duct, path[length - 1]);
+        }
+    }
+    shard->tasks.weight = 1;
+    fclose(file);
+    if (!valid) {
+        task_list_destroy(&shard->tasks);
+    }
+    return valid;
+}
+
+/**
+ * Counts the tasks of a shard file and prints its part record:
+ * "part <fingerprint> <index> <shards> <count>".
+ */
+COMMAND void shard_work(Duct* duct, const char* name, const Options* options) {
+    Shard shard;
+    if (!shard_read(duct, name, &shard)) {
+        printf("Unable to read shard %s for this plan.\n", name);
+        exit(1);
+    }
+    ullong result = shard.result;
+    if (!duct->infeasible) {
+        result += task_list_search(duct, &shard.tasks, options->threads, options->memo_bytes);
+    }
+    printf("part %016llx %llu %llu %llu\n", shard.fingerprint, shard.index, shard.shards, result);
+    task_list_destroy(&shard.tasks);
+}
+
+/**
+ * Sums the part records in files, every shard of one plan must be there once.
+ */
+COMMAND bool shard_merge(char** files, int size, Count* result) {
+    ullong fingerprint = 0;
+    ullong shards = 0;
+    uchar* seen = NULL;
+    bool valid = VALID;
+
+    count_set(result, 0);
+    result->size = 2;
+    for (int i = 0; i < size && valid; ++i) {
+        FILE* file = fopen(files[i], "r");
+        ullong part[2] = { 0, 0 };
+        ullong part_fingerprint, index, part_shards;
+        if (NULL == file) {
+            printf("Unable to read %s.\n", files[i]);
+            valid = INVALID;
+            break;
+        }
+        if (4 != fscanf(file, "part %llx %llu %llu %llu", &part_fingerprint, &index, &part_shards, part)) {
+            printf("No part record in %s.\n", files[i]);
+            valid = INVALID;
+        } else if (NULL == seen) {
+            fingerprint = part_fingerprint;
+            shards = part_shards;
+            seen = calloc(shards, sizeof(uchar));
+            if (NULL == seen) {
+                printf("Unable to allocate memory\n");
+                exit(1);
+            }
+        }
+        if (valid && (part_fingerprint != fingerprint || part_shards != shards || index >= shards)) {
+            printf("%s is a part of another count.\n", files[i]);
+            valid = INVALID;
+        } else if (valid && seen[index]) {
+            printf("Shard %llu is merged twice.\n", index);
+            valid = INVALID;
+        } else if (valid) {
+            seen[index] = 1;
+            count_add(result->limbs, part, 2);
+        }
+        fclose(file);
+    }
+    for (ullong i = 0; i < shards && valid; ++i) {
+        if (!seen[i]) {
+            printf("Shard %llu of %llu is missing.\n", i, shards);
+            valid = INVALID;
+        }
+    }
+    if (valid && NULL == seen) {
+        printf("No parts to merge.\n");
+        valid = INVALID;
+    }
+    free(seen);
+    return valid;
+}
+
+/**
+ * Writes every plan of input to stdout in the binary format.
+ */
+COMMAND void plan_convert(Input* input) {
+    while (input_more(input)) {
+        Plan plan;
+        if (!plan_read(input, &plan) || !plan_write(&plan, stdout)) {
+            fprintf(stderr, "error: %s\n", NULL != plan.error ? plan.error : "Invalid input.");
+        }
+        free(plan.values);
+    }
+}
+
+COMMAND void usage(char* name) {
+    printf("usage: %s [-e dfs|frontier|bidir|modular|external] [-t threads] [-d depth] [-m memo_mb] [-T spill_dir] [-k] [-b] [-w] [-l all|first:K|every:N|sample:K[:seed]] [-L] [-c file [-i seconds] [-r]] [-S shards:prefix | -W shard] [-E samples[:seed]] [-A] [-q] < grid\n"
+           "       %s -M part...\n"
+           "       %s -D socket [-e engine] [-t workers] [-o timeout_ms]\n"
+           "       %s -C socket < grids\n", name, name, name, name);
+    exit(1);
+}
+
+#ifndef AC_LIBRARY
+int main(int argc, char** argv) {
+    Count result;
+    Options options = { ENGINE_DFS, 1, 0, 0, NULL };
+    bool canonical = 0;
+    bool batch = 0;
+    bool convert = 0;
+    bool listing = 0;
+    bool text = 0;
+    ListMode list_mode = LIST_ALL;
+    ullong list_limit = 0;
+    ullong list_seed = 1;
+    const char* checkpoint_file = NULL;
+    long int checkpoint_ms = 60000;
+    bool resume = 0;
+    const char* shard_prefix = NULL;
+    int shards = 0;
+    const char* shard_file = NULL;
+    int merge = 0;
+    ullong samples = 0;
+    ullong sample_seed = 1;
+    bool pairs = 0;
+    bool what_if = 0;
+    const char* daemon_path = NULL;
+    const char* client_path = NULL;
+    long int timeout_ms = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "-e") && i + 1 < argc) {
+            char* name = argv[++i];
+            if (0 == strcmp(name, "dfs")) {
+                options.engine = ENGINE_DFS;
+            } else if (0 == strcmp(name, "frontier")) {
+                options.engine = ENGINE_FRONTIER;
+            } else if (0 == strcmp(name, "bidir")) {
+                options.engine = ENGINE_BIDIRECTIONAL;
+            } else if (0 == strcmp(name, "modular")) {
+                options.engine = ENGINE_MODULAR;
+            } else if (0 == strcmp(name, "external")) {
+                options.engine = ENGINE_EXTERNAL;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "-t") && i + 1 < argc) {
+            options.threads = atoi(argv[++i]);
+            if (options.threads < 1) {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "-d") && i + 1 < argc) {
+            options.depth = atoi(argv[++i]);
+            if (options.depth < 1 || options.depth >= MAX_AREA) {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "-m") && i + 1 < argc) {
+            int megabytes = atoi(argv[++i]);
+            if (megabytes < 1) {
+                usage(argv[0]);
+            }
+            options.memo_bytes = (size_t) megabytes << 20;
+        } else if (0 == strcmp(argv[i], "-T") && i + 1 < argc) {
+            options.spill_dir = argv[++i];
+        } else if (0 == strcmp(argv[i], "-k")) {
+            canonical = 1;
+        } else if (0 == strcmp(argv[i], "-b")) {
+            batch = 1;
+        } else if (0 == strcmp(argv[i], "-w")) {
+            convert = 1;
+        } else if (0 == strcmp(argv[i], "-l") && i + 1 < argc) {
+            listing = 1;
+            if (!list_parse(argv[++i], &list_mode, &list_limit, &list_seed)) {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "-L")) {
+            text = 1;
+        } else if (0 == strcmp(argv[i], "-c") && i + 1 < argc) {
+            checkpoint_file = argv[++i];
+        } else if (0 == strcmp(argv[i], "-i") && i + 1 < argc) {
+            checkpoint_ms = atol(argv[++i]) * 1000;
+            if (checkpoint_ms < 1000) {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "-r")) {
+            resume = 1;
+        } else if (0 == strcmp(argv[i], "-S") && i + 1 < argc) {
+            char* rest = NULL;
+            shards = strtol(argv[++i], &rest, 10);
+            if (shards < 1 || ':' != *rest || !rest[1]) {
+                usage(argv[0]);
+            }
+            shard_prefix = rest + 1;
+        } else if (0 == strcmp(argv[i], "-W") && i + 1 < argc) {
+            shard_file = argv[++i];
+        } else if (0 == strcmp(argv[i], "-E") && i + 1 < argc) {
+            char* rest = NULL;
+            samples = strtoull(argv[++i], &rest, 10);
+            if (':' == *rest) {
+                sample_seed = strtoull(rest + 1, &rest, 10);
+            }
+            if (!samples || '\0' != *rest) {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "-A")) {
+            pairs = 1;
+        } else if (0 == strcmp(argv[i], "-q")) {
+            what_if = 1;
+        } else if (0 == strcmp(argv[i], "-D") && i + 1 < argc) {
+            daemon_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "-C") && i + 1 < argc) {
+            client_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "-o") && i + 1 < argc) {
+            timeout_ms = atol(argv[++i]);
+            if (timeout_ms < 1) {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "-M")) {
+            // the part files are the remaining arguments.
+            merge = i + 1;
+            break;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (merge) {
+        if (!shard_merge(argv + merge, argc - merge, &result)) {
+            exit(1);
+        }
+        count_print(&result);
+        return 0;
+    }
+
+    if (NULL != daemon_path) {
+        return duct_daemon(daemon_path, &options, timeout_ms) ? 0 : 1;
+    }
+
+    if (NULL != client_path) {
+        return duct_client(client_path) ? 0 : 1;
+    }
+
+    // the input buffer is too large for the stack of some platforms.
+    static Input input;
+    input_init(&input);
+
+    if (convert) {
+        plan_convert(&input);
+        return 0;
+    }
+
+    if (batch) {
+        duct_batch(&input, &options);
+        return 0;
+    }
+
+    if (what_if) {
+        duct_session(&input);
+        return 0;
+    }
+
+    if (listing) {
+        Duct* duct = duct_init(&input);
+        if (NULL == duct || NULL != duct->error) {
+            printf("%s\n", NULL != duct ? duct->error : "Unable to allocate memory");
+            exit(1);
+        }
+        List list;
+        list_init(&list, list_mode, list_limit, list_seed, text, duct);
+        // every duct must be seen, the symmetry classes would skip some.
+        free(duct->weights);
+        duct->weights = NULL;
+        duct->list = &list;
+        duct_search_root(duct);
+        list_destroy(&list);
+        fprintf(stderr, "list: %llu ducts found, %llu written\n", list.found, list.written);
+        duct_destroy(duct);
+        return 0;
+    }
+
+    if (pairs) {
+        Plan plan;
+        if (!plan_read(&input, &plan)) {
+            printf("%s\n", plan.error);
+            exit(1);
+        }
+        bool counted = pairs_count(&plan);
+        free(plan.values);
+        return counted ? 0 : 1;
+    }
+
+    if (samples) {
+        long int start = clock_ms();
+        Duct* duct = duct_init(&input);
+        if (NULL == duct || NULL != duct->error) {
+            printf("%s\n", NULL != duct ? duct->error : "Unable to allocate memory");
+            exit(1);
+        }
+        double error = 0;
+        double estimate = duct_estimate(duct, samples, sample_seed, options.threads, &error);
+        printf("%.6e +- %.2e\n", estimate, error);
+        printf("time elapsed:%ld\n", clock_ms() - start);
+        duct_destroy(duct);
+        return 0;
+    }
+
+    if (NULL != shard_prefix || NULL != shard_file) {
+        if (options.engine != ENGINE_DFS) {
+            printf("Shards need the dfs engine.\n");
+            exit(1);
+        }
+        long int start = clock_ms();
+        Duct* duct = duct_init(&input);
+        if (NULL == duct || NULL != duct->error) {
+            printf("%s\n", NULL != duct ? duct->error : "Unable to allocate memory");
+            exit(1);
+        }
+        if (NULL != shard_prefix) {
+            if (!shard_write(duct, shard_prefix, shards, options.depth)) {
+                exit(1);
+            }
+        } else {
+            shard_work(duct, shard_file, &options);
+            printf("time elapsed:%ld\n", clock_ms() - start);
+        }
+        duct_destroy(duct);
+        return 0;
+    }
+
+    if (canonical) {
+        // print the canonical form of the plan instead of counting.
+        Duct* duct = duct_init(&input);
+        if (NULL == duct || NULL != duct->error) {
+            printf("%s\n", NULL != duct ? duct->error : "Unable to allocate memory");
+            exit(1);
+        }
+        ushort key[MAX_AREA + 2];
+        int length = duct_canonical(duct, key);
+        printf("%d %d\n", key[0], key[1]);
+        for (int i = 2; i < length; ++i) {
+            printf("%d%c", key[i], (i - 1) % key[0] ? ' ' : '\n');
+        }
+        duct_destroy(duct);
+        return 0;
+    }
+
+    long int start = clock_ms();
+    Duct* duct = duct_init(&input);
+    count_set(&result, 0);
+    if (NULL != duct) {
+        if (NULL != duct->error) {
+            printf("%s\n", duct->error);
+            exit(1);
+        }
+#ifdef DUCT_STATS
+        long int search = clock_ms();
+#endif
+        Checkpoint* checkpoint = NULL;
+        if (NULL != checkpoint_file) {
+            if (options.engine != ENGINE_DFS || options.threads > 1) {
+                printf("Checkpoints need the dfs engine on one thread.\n");
+                exit(1);
+            }
+            checkpoint = malloc(sizeof(Checkpoint));
+            if (NULL == checkpoint) {
+                printf("Unable to allocate memory\n");
+                exit(1);
+            }
+            checkpoint_init(checkpoint, checkpoint_file, checkpoint_ms, duct);
+            if (resume && !checkpoint_read(checkpoint)) {
+                printf("Unable to resume from %s.\n", checkpoint_file);
+                exit(1);
+            }
+            duct->checkpoint = checkpoint;
+        }
+        result = duct_count(duct, &options);
+        if (NULL != duct->failure) {
+            printf("%s\n", duct->failure);
+            exit(1);
+        }
+        if (NULL != checkpoint) {
+            // the count is done, a later run must not resume it.
+            remove(checkpoint_file);
+            free(checkpoint);
+            duct->checkpoint = NULL;
+        }
+#ifdef DUCT_STATS
+        stats_report(&duct->stats, clock_ms() - search);
+#endif
         duct_destroy(duct);
     }
-    clock_t end = clock();
+    long int end = clock_ms();
 
-    printf("%i\n", result);
-    printf("time elapsed:%ld\n", (long int) ((end-start) * 1000/CLOCKS_PER_SEC) );
+    count_print(&result);
+    printf("time elapsed:%ld\n", end - start);
     return 0;
 }
+#endif
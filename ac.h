@@ -0,0 +1,78 @@
+#ifndef AC_H
+#define AC_H
+
+#include "stddef.h"
+
+/**
+ * Library interface of ac, built by compiling ac.c with -DAC_LIBRARY.
+ *
+ * A context holds one plan, read from memory instead of stdin; bad plans
+ * and counts that can not be done are reported with a status, the library
+ * never ends the process nor writes to stdout.  Contexts share nothing, so
+ * threads may count different contexts at the same time but not the same
+ * one.  Only the ac_ functions are exported.
+ *
+ *     AcContext* context = NULL;
+ *     int rooms[] = { 2, 0, 0, 0,  0, 0, 0, 0,  0, 0, 3, 1 };
+ *     char count[AC_COUNT_DIGITS];
+ *     if (AC_OK == ac_create(&context, 4, 3, rooms) &&
+ *         AC_OK == ac_count(context, AC_ENGINE_FRONTIER, 1000, count, sizeof(count))) {
+ *         puts(count);
+ *     } else {
+ *         puts(ac_error(context));
+ *     }
+ *     ac_destroy(context);
+ */
+
+// Room values of a plan, as in the input format.
+#define AC_ROOM_OURS   0
+#define AC_ROOM_OTHERS 1
+#define AC_ROOM_INTAKE 2
+#define AC_ROOM_AC     3
+
+// Longest count in decimal, with its terminating zero.
+#define AC_COUNT_DIGITS 640
+
+typedef enum AcStatusEnum {
+    AC_OK,
+    AC_BAD_PLAN,        // the plan breaks a rule, ac_error tells which.
+    AC_BAD_ENGINE,      // the engine can not count this plan.
+    AC_TIMEOUT,         // the count took longer than its timeout and was dropped.
+    AC_SHORT_BUFFER,    // the count does not fit in the buffer.
+    AC_CHECK_FAILED,    // the count failed its own check, ac_error tells which.
+    AC_IO_FAILED,       // a spill file of the external engine failed, ac_error tells how.
+    AC_NO_MEMORY
+} AcStatus;
+
+typedef enum AcEngineEnum {
+    AC_ENGINE_DFS,
+    AC_ENGINE_FRONTIER,
+    AC_ENGINE_BIDIRECTIONAL,
+    AC_ENGINE_MODULAR,
+    AC_ENGINE_EXTERNAL
+} AcEngine;
+
+typedef struct AcContextStruct AcContext;
+
+/**
+ * Creates a context for a plan of width x height rooms in reading order.
+ * The context is created even for a bad plan, so ac_error can tell why;
+ * it must be freed with ac_destroy either way.
+ */
+AcStatus ac_create(AcContext** context, int width, int height, const int* rooms);
+
+/**
+ * Counts the ducts of the plan into count, in decimal.  A timeout_ms of 0
+ * or less waits as long as the count takes.  The modular, bidirectional and
+ * external engines report on stderr as the command does.
+ */
+AcStatus ac_count(AcContext* context, AcEngine engine, long int timeout_ms, char* count, size_t size);
+
+/**
+ * Why the last call on the context failed, or "" if it did not.
+ */
+const char* ac_error(const AcContext* context);
+
+void ac_destroy(AcContext* context);
+
+#endif
@@ -0,0 +1,137 @@
+#!/bin/sh
+#
+# Times the engines of ac on a set of plans and checks their counts.
+#
+# A plan is either a grid file or gen:W:H[:density[:seed[:placement]]], a
+# plan written by ./gen with those arguments.  Grid files listed in
+# answers.txt must match their known count, every other plan must match
+# the count of the frontier engine.  Each engine runs -r times per plan and
+# the time ac reports is summarised by its median, mean and variance.
+#
+# With -b, the medians are compared with a CSV written by an earlier run and
+# a median more than -s percent (and 20 ms) slower counts as a regression.
+#
+# Exits with 1 on a wrong count or a regression.
+
+AC=./ac
+RUNS=5
+ENGINES="dfs frontier bidir modular"
+FORMAT=csv
+FLAGS=
+BASELINE=
+SLACK=25
+
+usage() {
+    echo "usage: $0 [-x ac] [-r runs] [-e engines] [-a ac_flags] [-f csv|json] [-b baseline.csv] [-s slack] [plans...]" >&2
+    exit 1
+}
+
+while getopts "x:r:e:a:f:b:s:" option; do
+    case $option in
+        x) AC=$OPTARG ;;
+        r) RUNS=$OPTARG ;;
+        e) ENGINES=$OPTARG ;;
+        a) FLAGS=$OPTARG ;;
+        f) FORMAT=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        s) SLACK=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || set -- 43.txt 66.txt 76.txt 77.txt 78.txt 88.txt
+[ "$FORMAT" = csv ] || [ "$FORMAT" = json ] || usage
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+GRID=$(mktemp)
+TIMES=$(mktemp)
+trap 'rm -f "$GRID" "$TIMES"' EXIT
+STATUS=0
+FIRST=1
+
+# the grid file of a plan, generated plans are written to $GRID.
+plan_file() {
+    case $1 in
+        gen:*)
+            echo "$1" | cut -d: -f2- | tr ':' ' ' | xargs "$DIR/gen" > "$GRID" || exit 1
+            echo "$GRID"
+            ;;
+        *)
+            echo "$1"
+            ;;
+    esac
+}
+
+if [ "$FORMAT" = csv ]; then
+    echo "plan,engine,runs,count,expected,ok,median_ms,mean_ms,variance_ms2,min_ms,max_ms"
+else
+    echo "["
+fi
+
+for plan in "$@"; do
+    file=$(plan_file "$plan")
+    expected=$(awk -v plan="$(basename "$plan")" '$1 == plan { print $2 }' "$DIR/answers.txt")
+    if [ -z "$expected" ]; then
+        expected=$("$AC" -e frontier < "$file" 2> /dev/null | head -n 1)
+    fi
+
+    for engine in $ENGINES; do
+        : > "$TIMES"
+        count=
+        ok=1
+        run=0
+        while [ $run -lt "$RUNS" ]; do
+            # shellcheck disable=SC2086
+            output=$("$AC" -e "$engine" $FLAGS < "$file" 2> /dev/null)
+            result=$(echo "$output" | head -n 1)
+            [ -n "$count" ] && [ "$result" != "$count" ] && ok=0
+            count=$result
+            echo "$output" | sed -n 's/^time elapsed://p' >> "$TIMES"
+            run=$((run + 1))
+        done
+        [ "$count" = "$expected" ] || ok=0
+        if [ $ok = 0 ]; then
+            echo "bench: $plan $engine counted $count, expected $expected" >&2
+            STATUS=1
+        fi
+
+        # median, mean, sample variance, min and max of the reported times.
+        stats=$(sort -n "$TIMES" | awk '
+            { t[NR] = $1; sum += $1 }
+            END {
+                if (!NR) { print "0 0 0 0 0"; exit }
+                mean = sum / NR
+                for (i = 1; i <= NR; ++i) { var += (t[i] - mean) ^ 2 }
+                var = NR > 1 ? var / (NR - 1) : 0
+                median = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+                printf "%g %.1f %.1f %d %d", median, mean, var, t[1], t[NR]
+            }')
+        read -r median mean variance min max <<EOF
+$stats
+EOF
+
+        if [ -n "$BASELINE" ]; then
+            before=$(awk -F, -v plan="$plan" -v engine="$engine" \
+                '$1 == plan && $2 == engine { print $7 }' "$BASELINE")
+            if [ -n "$before" ] && awk -v now="$median" -v before="$before" -v slack="$SLACK" \
+                'BEGIN { exit !(now > before * (1 + slack / 100) && now > before + 20) }'; then
+                echo "bench: $plan $engine regressed from $before ms to $median ms" >&2
+                STATUS=1
+            fi
+        fi
+
+        if [ "$FORMAT" = csv ]; then
+            echo "$plan,$engine,$RUNS,$count,$expected,$ok,$median,$mean,$variance,$min,$max"
+        else
+            [ $FIRST = 1 ] || echo ","
+            FIRST=0
+            printf '  {"plan": "%s", "engine": "%s", "runs": %s, "count": "%s", "expected": "%s", "ok": %s, ' \
+                "$plan" "$engine" "$RUNS" "$count" "$expected" "$([ $ok = 1 ] && echo true || echo false)"
+            printf '"median_ms": %s, "mean_ms": %s, "variance_ms2": %s, "min_ms": %s, "max_ms": %s}' \
+                "$median" "$mean" "$variance" "$min" "$max"
+        fi
+    done
+done
+
+[ "$FORMAT" = csv ] || printf '\n]\n'
+exit $STATUS
@@ -0,0 +1,77 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+/**
+ * Writes a random data center plan in the format ac reads.
+ *
+ * Every room but the intake and the AC is not ours with the given
+ * probability.  The intake and the AC are placed by one of:
+ *   corners:  intake top left, AC bottom left, as in the README example.
+ *   opposite: intake top left, AC bottom right.
+ *   random:   two distinct random rooms.
+ */
+
+typedef unsigned long long ullong;
+
+ullong seed_state = 1;
+
+/**
+ * xorshift64*, good enough to scatter rooms and reproducible across libcs.
+ */
+ullong gen_random() {
+    seed_state ^= seed_state >> 12;
+    seed_state ^= seed_state << 25;
+    seed_state ^= seed_state >> 27;
+    return seed_state * 0x2545F4914F6CDD1DULL;
+}
+
+void usage(char* name) {
+    printf("usage: %s width height [density] [seed] [corners|opposite|random]\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3 || argc > 6) {
+        usage(argv[0]);
+    }
+    int width = atoi(argv[1]);
+    int height = atoi(argv[2]);
+    double density = argc > 3 ? atof(argv[3]) : 0;
+    ullong seed = argc > 4 ? strtoull(argv[4], NULL, 10) : 1;
+    char* placement = argc > 5 ? argv[5] : "corners";
+
+    if (width < 2 || height < 2 || density < 0 || density >= 1) {
+        usage(argv[0]);
+    }
+    seed_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    int area = width * height;
+    int start = 0;
+    int end = 0;
+    if (0 == strcmp(placement, "corners")) {
+        end = (height - 1) * width;
+    } else if (0 == strcmp(placement, "opposite")) {
+        end = area - 1;
+    } else if (0 == strcmp(placement, "random")) {
+        start = gen_random() % area;
+        end = gen_random() % (area - 1);
+        end += end >= start;
+    } else {
+        usage(argv[0]);
+    }
+
+    printf("%d %d\n", width, height);
+    for (int i = 0; i < area; ++i) {
+        int value = 0;
+        if (i == start) {
+            value = 2;
+        } else if (i == end) {
+            value = 3;
+        } else if ((gen_random() >> 11) * (1.0 / (1ULL << 53)) < density) {
+            value = 1;
+        }
+        printf("%d%c", value, (i + 1) % width ? ' ' : '\n');
+    }
+    return 0;
+}